@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -36,7 +37,7 @@
 
 struct pre_aliases {
 	std::array<std::vector<uint16_t>, MAX_MOD> modifiers;
-	std::vector<std::pair<const_string, std::vector<alias>>> aliases;
+	std::vector<std::pair<const_string, std::vector<alias>>> aliases; // Sorted by name
 };
 
 enum class action_arg_e : signed char {
@@ -81,10 +82,14 @@ constexpr struct {
 
 	{ "macro2", 	NULL,	OP_MACRO2,	{ ARG_TIMEOUT, ARG_TIMEOUT, ARG_MACRO } },
 	{ "setlayout", 	NULL,	OP_LAYOUT,	{ ARG_LAYOUT } },
+	{ "leader", 	NULL,	OP_LEADER,	{} },
 
 	/* Experimental */
 	{ "scrollt", 	NULL,	OP_SCROLL_TOGGLE,		{ARG_SENSITIVITY} },
 	{ "scroll", 	NULL,	OP_SCROLL,			{ARG_SENSITIVITY} },
+	{ "mousemove", 	NULL,	OP_MOUSE_MOVE,			{ARG_SENSITIVITY, ARG_SENSITIVITY} },
+	{ "mousespeed", NULL,	OP_MOUSE_SPEED,			{ARG_SENSITIVITY} },
+	{ "mousedrag", 	NULL,	OP_MOUSE_DRAG,			{} },
 
 	/* TODO: deprecate */
 	{ "overload2", 	"overloadt",	OP_OVERLOAD_TIMEOUT,		{ ARG_LAYER, ARG_DESCRIPTOR, ARG_TIMEOUT } },
@@ -179,27 +184,46 @@ bool descriptor::operator==(const descriptor& b) const
 
 void descriptor_map::sort()
 {
-	std::sort(mapv.begin(), mapv.end());
+	// Frozen tables were sorted before they were frozen
+	if (mapv.frozen())
+		return;
+
+	// Keep the last binding of each key, in the order they were set
+	const auto begin = mapv.mutable_data();
+	std::stable_sort(begin, begin + mapv.size());
+	auto out = begin;
+	for (auto it = begin, end = begin + mapv.size(); it != end;) {
+		auto next = std::find_if(it, end, [&](const descriptor& d) {
+			return !(d == *it);
+		});
+		// Unbinding a key that was never bound doesn't add it
+		if (std::any_of(it, next, [](const descriptor& d) { return !!d; }))
+			*out++ = next[-1];
+		it = next;
+	}
+	mapv.truncate(out - begin);
 }
 
 void descriptor_map::set(const descriptor& copy, bool sorted)
 {
-	const auto found = std::find(mapv.begin(), mapv.end(), copy);
-	if (found != mapv.end()) {
-		*found = copy;
+	if (!sorted) {
+		// Staged until sort()
+		mapv.push_back(copy);
 		return;
 	}
 
-	if (!copy) {
+	const auto pos = std::lower_bound(mapv.begin(), mapv.end(), copy);
+	const size_t idx = pos - mapv.begin();
+	if (pos != mapv.end() && *pos == copy) {
+		mapv.mutable_data()[idx] = copy;
 		return;
 	}
 
-	auto pos = mapv.end();
-	if (sorted) {
-		// If already sorted, find exact insert position
-		pos = std::lower_bound(mapv.begin(), mapv.end(), copy);
+	if (!copy) {
+		return;
 	}
-	mapv.emplace(pos, copy);
+
+	mapv.insert(idx, copy);
 }
 
 const descriptor& descriptor_map::operator[](const descriptor& copy) const
@@ -247,18 +271,55 @@ static const_string resolve_include_path(const char* path, std::string_view incl
 	return resolved_path;
 }
 
-// Callback: path, line number, line
-static bool read_ini_file(const char* path, size_t max_depth, auto&& cb)
+struct ini_cache::file {
+	struct entry {
+		std::string_view line; // Include path for includes
+		size_t ln;
+		const file* include;
+	};
+
+	const_string path;
+	file_mapper map;
+	std::vector<entry> entries; // Non-empty lines, comments filtered out
+
+	file(const char* path)
+		: path(make_string(path))
+		, map(open(path, O_RDONLY))
+	{
+	}
+};
+
+ini_cache::ini_cache() = default;
+ini_cache::~ini_cache() = default;
+
+const char* ini_cache::path(size_t idx) const
 {
-	file_mapper file(open(path, O_RDONLY));
-	if (!file) {
+	return files[idx]->path.c_str();
+}
+
+std::string_view ini_cache::data(size_t idx) const
+{
+	return files[idx]->map.view();
+}
+
+// Map and split a file, unless the cache already has it
+static const ini_cache::file* ini_load(ini_cache& cache, const char* path)
+{
+	for (auto& f : cache.files) {
+		if (f->path == std::string_view(path))
+			return f.get();
+	}
+
+	// Registered first so that cyclic includes find it
+	auto& file = *cache.files.emplace_back(std::make_unique<ini_cache::file>(path));
+	if (!file.map) {
 		keyd_log("Unable to open %s\n", path);
-		return false;
+		return &file;
 	}
 
 	std::size_t nline = 0;
 
-	for (auto line : split_char<'\n'>(file.view())) {
+	for (auto line : split_char<'\n'>(file.map.view())) {
 		if (line.starts_with("include ") || line.starts_with("include\t")) {
 			auto include_path = line.substr(8);
 
@@ -268,22 +329,42 @@ static bool read_ini_file(const char* path, size_t max_depth, auto&& cb)
 				continue;
 			}
 
-			if (!max_depth) {
-				warn("include depth too big or cyclic: %.*s", (int)include_path.size(), include_path.data());
-				continue;
-			}
-
-			read_ini_file(resolved_path.c_str(), max_depth - 1, std::move(cb));
+			auto include = ini_load(cache, resolved_path.c_str());
+			file.entries.push_back({include_path, nline, include});
 		} else {
 			// Filter spaces and comments
 			line = line.substr(std::min(line.size(), line.find_first_not_of(C_SPACES)));
 			line = line.substr(0, line.find_last_not_of(C_SPACES) + 1);
 			if (!line.empty() && !line.starts_with('#'))
-				cb(path, nline, line);
+				file.entries.push_back({line, nline, nullptr});
 		}
 		nline++;
 	}
 
+	return &file;
+}
+
+static void ini_walk(const ini_cache::file& file, size_t max_depth, auto& cb)
+{
+	for (auto& e : file.entries) {
+		if (!e.include) {
+			cb(file.path.c_str(), e.ln, e.line);
+		} else if (!max_depth) {
+			warn("include depth too big or cyclic: %.*s", (int)e.line.size(), e.line.data());
+		} else if (e.include->map) {
+			ini_walk(*e.include, max_depth - 1, cb);
+		}
+	}
+}
+
+// Callback: path, line number, line
+static bool read_ini_file(ini_cache& cache, const char* path, size_t max_depth, auto&& cb)
+{
+	auto file = ini_load(cache, path);
+	if (!file->map)
+		return false;
+
+	ini_walk(*file, max_depth, cb);
 	return true;
 }
 
@@ -361,11 +442,12 @@ static std::pair<descriptor, std::string_view> lookup_keycode(std::string_view s
 	}
 }
 
-static struct descriptor *layer_lookup_chord(struct layer *layer, decltype(chord::keys)& keys, size_t n)
+// Returns the index of the chord, or -1
+static int layer_lookup_chord(struct layer *layer, decltype(chord::keys)& keys, size_t n)
 {
 	for (size_t i = 0; i < layer->chords.size(); i++) {
 		size_t nm = 0;
-		struct chord *chord = &layer->chords[i];
+		const struct chord *chord = &layer->chords[i];
 
 		for (size_t j = 0; j < n; j++) {
 			for (size_t k = 0; k < chord->keys.size(); k++)
@@ -376,10 +458,10 @@ static struct descriptor *layer_lookup_chord(struct layer *layer, decltype(chord
 		}
 
 		if (nm == n)
-			return &chord->d;
+			return i;
 	}
 
-	return NULL;
+	return -1;
 }
 
 static uint8_t get_mods(long idx)
@@ -404,6 +486,14 @@ static uint8_t get_mods(const struct config* cfg, const struct layer* layer)
 
 static int parse_descriptor(std::string_view s, struct descriptor *d, struct config *config);
 
+static void layer_set(struct config *config, struct layer *layer, const descriptor& desc)
+{
+	layer->keymap.set(desc, config->finalized);
+	// Unbinding leaves the key bound (to nothing) or doesn't add it
+	if (config->finalized && desc)
+		config->update_binding(*layer, desc);
+}
+
 static bool set_layer_entry(struct config *config, int16_t idx, std::string_view s)
 {
 	struct chord chord{};
@@ -450,11 +540,15 @@ static bool set_layer_entry(struct config *config, int16_t idx, std::string_view
 			if (parse_descriptor(get_ini_value(next), d, config) < 0)
 				return false;
 
-			if (!(d = layer_lookup_chord(&config->layers[idx], chord.keys, n))) {
-				config->layers[idx].chords.emplace_back(chord).d = dd;
+			auto& chords = config->layers[idx].chords;
+			if (int i = layer_lookup_chord(&config->layers[idx], chord.keys, n); i < 0) {
+				chord.d = dd;
+				chords.push_back(chord);
 			} else {
-				*d = dd;
+				chords.mutable_data()[i].d = dd;
 			}
+			if (config->finalized)
+				config->update_binding(config->layers[idx], dd, &chord);
 			return true;
 		}
 
@@ -467,9 +561,10 @@ static bool set_layer_entry(struct config *config, int16_t idx, std::string_view
 
 		// parse_descriptor can create layers, so use idx
 		struct layer* layer = &config->layers[idx];
-		for (auto& [name, list] : config->aliases) {
-			if (name != aname)
-				continue;
+		if (auto it = std::lower_bound(config->aliases.begin(), config->aliases.end(), aname, [](const alias_list& a, std::string_view name) {
+			return a.name < name;
+		}); it != config->aliases.end() && it->name == aname) {
+			auto& list = it->list;
 			// Lookup mods, use key descriptor as aux, and desc as value descriptor
 			descriptor aux = desc;
 			descriptor desc = *d;
@@ -485,10 +580,10 @@ static bool set_layer_entry(struct config *config, int16_t idx, std::string_view
 				if (desc.id >= KEYD_ENTRY_COUNT) {
 					for (uint16_t id : config->modifiers.at(desc.id - KEYD_ENTRY_COUNT)) {
 						desc.id = id;
-						layer->keymap.set(desc, config->finalized);
+						layer_set(config, layer, desc);
 					}
 				} else {
-					layer->keymap.set(desc, config->finalized);
+					layer_set(config, layer, desc);
 				}
 			}
 			return true;
@@ -509,10 +604,10 @@ static bool set_layer_entry(struct config *config, int16_t idx, std::string_view
 			if (desc.id >= KEYD_ENTRY_COUNT) {
 				for (uint16_t id : config->modifiers.at(desc.id - KEYD_ENTRY_COUNT)) {
 					desc.id = id;
-					layer->keymap.set(desc, config->finalized);
+					layer_set(config, layer, desc);
 				}
 			} else {
-				layer->keymap.set(desc, config->finalized);
+				layer_set(config, layer, desc);
 			}
 		}
 
@@ -928,6 +1023,14 @@ static void parse_global_section(struct config* config, const char* file, size_t
 		return;
 	else if (parse_int("overload_tap_timeout", config->overload_tap_timeout, s, 0))
 		return;
+	else if (parse_int("overload_streak_timeout", config->overload_streak_timeout, s, 0))
+		return;
+	else if (parse_int("leader_timeout", config->leader_timeout, s, 0))
+		return;
+	else if (parse_int("mouse_accel_time", config->mouse_accel_time, s, 0))
+		return;
+	else if (parse_int("mouse_initial_speed", config->mouse_initial_speed, s, 0, 100))
+		return;
 	else
 		warn("[%s] line %zd: %.*s is not a valid global option", file, ln, (int)s.size(), s.data());
 }
@@ -1019,15 +1122,14 @@ static void parse_alias_section(struct pre_aliases* config, const char* file, si
 						.mods = desc.mods,
 						.wildcard = desc.wildcard,
 					};
-					for (auto& [n, list] : config->aliases) {
-						if (n == name) {
-							list.emplace_back(a);
-							return;
-						}
+					auto it = std::lower_bound(config->aliases.begin(), config->aliases.end(), name, [](auto& ent, std::string_view name) {
+						return ent.first < name;
+					});
+					if (it == config->aliases.end() || it->first != name) {
+						it = config->aliases.emplace(it);
+						it->first = (aux_alloc(), make_string(name));
 					}
-					config->aliases.emplace_back();
-					config->aliases.back().first = (aux_alloc(), make_string(name));
-					config->aliases.back().second.emplace_back(a);
+					it->second.emplace_back(a);
 				}
 				return;
 			}
@@ -1037,11 +1139,224 @@ static void parse_alias_section(struct pre_aliases* config, const char* file, si
 	}
 }
 
+/* Key that types an ASCII character on a US layout. */
+static uint16_t char_symbol(char c)
+{
+	uint8_t kind;
+	int code = lookup_key_name(std::string_view(&c, 1), &kind);
+	if (code <= 0 || kind == KEYNAME_ALT)
+		return 0;
+
+	return abbrev_automaton::symbol(code, kind == KEYNAME_SHIFTED);
+}
+
+/* Pending [abbreviations] entries, compiled by build_abbrevs(). */
+struct pre_abbrev {
+	std::vector<uint16_t> symbols;
+	uint16_t macro;
+};
+
+static void parse_abbrev_section(struct config* config, std::vector<pre_abbrev>& abbrevs, const char* file, size_t ln, std::string_view s)
+{
+	if (s.empty())
+		return;
+
+	const size_t eq = s.find('=', 1);
+	if (eq + 1 == 0) {
+		keyd_log("\tr{ERROR:} [%s] line m{%zd}: expected <abbreviation> = <expansion>\n", file, ln);
+		return;
+	}
+
+	std::string_view name = s.substr(0, eq);
+	std::string_view exp = s.substr(eq + 1);
+	name.remove_suffix(name.size() - (name.find_last_not_of(C_SPACES) + 1));
+	exp.remove_prefix(std::min(exp.find_first_not_of(C_SPACES), exp.size()));
+	if (exp.starts_with("macro(") && exp.ends_with(')'))
+		exp = exp.substr(6, exp.size() - 7);
+
+	pre_abbrev abbrev{};
+	for (char c : name) {
+		if (uint16_t sym = char_symbol(c)) {
+			abbrev.symbols.push_back(sym);
+		} else {
+			keyd_log("\tr{ERROR:} [%s] line m{%zd}: cannot type '%c' in an abbreviation\n", file, ln, c);
+			return;
+		}
+	}
+
+	if (abbrev.symbols.empty() || exp.empty()) {
+		keyd_log("\tr{ERROR:} [%s] line m{%zd}: expected <abbreviation> = <expansion>\n", file, ln);
+		return;
+	}
+
+	// Erase the typed abbreviation first
+	std::string buf;
+	for (size_t i = 0; i < abbrev.symbols.size(); i++)
+		buf += "backspace ";
+	buf += exp;
+
+	::macro macro;
+	if (macro_parse(buf, macro, config, config->cmd_env) < 0) {
+		keyd_log("\tr{ERROR:} [%s] line m{%zd}: %s\n", file, ln, errstr);
+		return;
+	}
+
+	abbrev.macro = config->macros.size();
+	config->macros.emplace_back(std::move(macro));
+	abbrevs.emplace_back(std::move(abbrev));
+}
+
+static void build_abbrevs(struct config* config, const std::vector<pre_abbrev>& abbrevs)
+{
+	auto& ac = config->abbrevs;
+	ac = {};
+	if (abbrevs.empty())
+		return;
+
+	for (auto& abbrev : abbrevs) {
+		for (uint16_t sym : abbrev.symbols) {
+			if (!ac.column[sym])
+				ac.column[sym] = ac.ncols++;
+		}
+	}
+
+	if (ac.ncols > UINT8_MAX) {
+		warn("too many distinct characters in abbreviations");
+		return;
+	}
+
+	// Trie, 0 marks a missing transition (the root is never a child)
+	ac.next.resize(ac.ncols);
+	ac.match.resize(1);
+	for (auto& abbrev : abbrevs) {
+		uint32_t state = 0;
+		for (uint16_t sym : abbrev.symbols) {
+			uint32_t& next = ac.next[state * ac.ncols + ac.column[sym]];
+			if (!next) {
+				next = ac.match.size();
+				ac.match.push_back(0);
+				ac.next.resize(ac.next.size() + ac.ncols);
+			}
+			state = ac.next[state * ac.ncols + ac.column[sym]];
+		}
+		// First definition wins
+		if (!ac.match[state])
+			ac.match[state] = abbrev.macro + 1;
+	}
+
+	// Turn the trie into a DFA following failure links breadth-first
+	std::vector<uint32_t> fail(ac.match.size());
+	std::vector<uint32_t> queue;
+	for (uint32_t c = 0; c < ac.ncols; c++) {
+		if (uint32_t child = ac.next[c])
+			queue.push_back(child);
+	}
+
+	for (size_t i = 0; i < queue.size(); i++) {
+		const uint32_t state = queue[i];
+		if (!ac.match[state])
+			ac.match[state] = ac.match[fail[state]];
+		for (uint32_t c = 0; c < ac.ncols; c++) {
+			uint32_t& next = ac.next[state * ac.ncols + c];
+			const uint32_t fallback = ac.next[fail[state] * ac.ncols + c];
+			if (next) {
+				fail[next] = fallback;
+				queue.push_back(next);
+			} else {
+				next = fallback;
+			}
+		}
+	}
+}
+
+/* [leader] entries as a trie with per-node child lists, see build_leader(). */
+struct pre_leader_node {
+	std::vector<std::pair<uint16_t, uint32_t>> children;
+	struct descriptor d;
+};
+
+static void parse_leader_section(struct config* config, std::vector<pre_leader_node>& nodes, const char* file, size_t ln, std::string_view s)
+{
+	if (s.empty())
+		return;
+
+	const size_t eq = s.find('=', 1);
+	if (eq + 1 == 0) {
+		keyd_log("\tr{ERROR:} [%s] line m{%zd}: expected <key> <key>... = <action>\n", file, ln);
+		return;
+	}
+
+	std::string_view exp = s.substr(eq + 1);
+	exp.remove_prefix(std::min(exp.find_first_not_of(C_SPACES), exp.size()));
+
+	struct descriptor d{};
+	if (parse_descriptor(exp, &d, config)) {
+		keyd_log("\tr{ERROR:} [%s] line m{%zd}: %s\n", file, ln, errstr);
+		return;
+	} else if (!d) {
+		keyd_log("\tr{ERROR:} [%s] line m{%zd}: expected <key> <key>... = <action>\n", file, ln);
+		return;
+	}
+
+	if (nodes.empty())
+		nodes.emplace_back();
+
+	uint32_t node = 0;
+	for (auto key : split_char<' '>(s.substr(0, eq))) {
+		if (key.empty())
+			continue;
+
+		uint16_t code;
+		uint8_t mods, wildc;
+		if (parse_key_sequence(key, &code, &mods, &wildc) != 0 || !code || mods || wildc) {
+			keyd_log("\tr{ERROR:} [%s] line m{%zd}: %.*s is not a valid key\n", file, ln, (int)key.size(), key.data());
+			return;
+		}
+
+		auto& children = nodes[node].children;
+		auto it = std::find_if(children.begin(), children.end(), [&](auto& c) { return c.first == code; });
+		if (it != children.end()) {
+			node = it->second;
+		} else {
+			children.emplace_back(code, nodes.size());
+			node = nodes.size();
+			nodes.emplace_back();
+		}
+	}
+
+	if (!node) {
+		keyd_log("\tr{ERROR:} [%s] line m{%zd}: empty key sequence\n", file, ln);
+		return;
+	}
+
+	nodes[node].d = d;
+}
+
+static void build_leader(struct config* config, std::vector<pre_leader_node>& nodes)
+{
+	auto& trie = config->leader;
+	trie = {};
+	if (nodes.empty())
+		return;
+
+	trie.nodes.reserve(nodes.size());
+	for (auto& node : nodes) {
+		std::sort(node.children.begin(), node.children.end());
+		trie.nodes.push_back({
+			.first = uint32_t(trie.edges.size()),
+			.count = uint32_t(node.children.size()),
+			.d = node.d,
+		});
+		for (auto [code, child] : node.children)
+			trie.edges.push_back({ .code = code, .node = child });
+	}
+}
+
 void config_null_parser(struct config*, const char*, size_t, std::string_view)
 {
 }
 
-bool config_parse(struct config *config, const char *path)
+bool config_parse(struct config *config, const char *path, struct ini_cache *cache)
 {
 	pre_aliases aliases;
 	aliases.modifiers[MOD_ALT] = {KEY_LEFTALT};
@@ -1050,10 +1365,22 @@ bool config_parse(struct config *config, const char *path)
 	aliases.modifiers[MOD_CTRL] = {KEY_LEFTCTRL, KEY_RIGHTCTRL};
 	aliases.modifiers[MOD_ALT_GR] = {KEY_RIGHTALT};
 
-	// First pass
-	size_t chksum0 = 0;
-	if (auto section_parser = config_null_parser; !read_ini_file(path, 10, [&](const char* file, size_t ln, std::string_view line) {
-		chksum0 ^= std::hash<std::string_view>()(line);
+	ini_cache local_cache;
+	if (!cache)
+		cache = &local_cache;
+
+	/*
+	 * Bindings may refer to aliases defined further down, so other
+	 * sections are recorded (headers included) and bound afterwards.
+	 */
+	struct deferred_line {
+		const char* file;
+		size_t ln;
+		std::string_view line;
+	};
+	std::vector<deferred_line> deferred;
+
+	if (auto section_parser = config_null_parser; !read_ini_file(*cache, path, 10, [&](const char* file, size_t ln, std::string_view line) {
 		if (line.starts_with('[') && line.ends_with(']')) {
 			if (line == "[ids]")
 				section_parser = parse_id_section;
@@ -1063,6 +1390,10 @@ bool config_parse(struct config *config, const char *path)
 				section_parser = nullptr;
 			else
 				section_parser = config_null_parser;
+			deferred.push_back({file, ln, line});
+		} else if (section_parser == config_null_parser) {
+			if (!deferred.empty())
+				deferred.push_back({file, ln, line});
 		} else if (section_parser) {
 			section_parser(config, file, ln, line);
 		} else {
@@ -1076,6 +1407,7 @@ bool config_parse(struct config *config, const char *path)
 		for (size_t i = 0; i < MAX_MOD; i++) {
 			config->modifiers[i] = make_smart_array(aliases.modifiers[i]);
 		}
+		config->update_mod_table();
 		if (size_t sz = aliases.aliases.size()) {
 			config->aliases = make_smart_ptr<alias_list[], false>(sz);
 			for (size_t i = 0; i < sz; i++) {
@@ -1085,13 +1417,17 @@ bool config_parse(struct config *config, const char *path)
 		}
 	}
 
-	// Second pass
-	size_t chksum1 = 0;
-	if (int layer = -1; !read_ini_file(path, 10, [&](const char* file, size_t ln, std::string_view line) {
-		chksum1 ^= std::hash<std::string_view>()(line);
+	std::vector<pre_abbrev> abbrevs;
+	std::vector<pre_leader_node> leader;
+	int layer = -1;
+	for (auto [file, ln, line] : deferred) {
 		if (line.starts_with('[') && line.ends_with(']')) {
 			if (line == "[ids]" || line == "[global]" || line == "[aliases]") {
 				layer = -1;
+			} else if (line == "[abbreviations]") {
+				layer = -2;
+			} else if (line == "[leader]") {
+				layer = -3;
 			} else {
 				line.remove_prefix(1);
 				line.remove_suffix(1);
@@ -1137,15 +1473,15 @@ bool config_parse(struct config *config, const char *path)
 		} else if (layer >= 0) {
 			if (!set_layer_entry(config, layer, line))
 				keyd_log("\tr{ERROR:} [%s] line m{%zd}: %s\n", file, ln, errstr);
+		} else if (layer == -2) {
+			parse_abbrev_section(config, abbrevs, file, ln, line);
+		} else if (layer == -3) {
+			parse_leader_section(config, leader, file, ln, line);
 		}
-	})) {
-		return false;
 	}
 
-	if (chksum0 != chksum1) {
-		warn("Checksums don't match, something did interfere with config files.");
-		return false;
-	}
+	build_abbrevs(config, abbrevs);
+	build_leader(config, leader);
 
 	config->add_right_wildc = 0;
 	config->add_right_mods = 0;
@@ -1181,6 +1517,75 @@ int config_check_match(struct config *config, const char *id, uint8_t flags)
 	return 0;
 }
 
+void config_match_index::add(const struct config *config)
+{
+	for (size_t i = 0; i < config->ids.size(); i++) {
+		entry ent{config->ids[i].id, count, uint16_t(i), config->ids[i].flags};
+		auto pos = std::upper_bound(ids.begin(), ids.end(), ent, [](const entry& a, const entry& b) {
+			return std::string_view(a.id.data()) < std::string_view(b.id.data());
+		});
+		ids.insert(pos, ent);
+	}
+	if (config->wildcard)
+		wildcards.emplace_back(count, config->wildcard);
+	count++;
+}
+
+void config_match_index::clear()
+{
+	ids.clear();
+	wildcards.clear();
+	count = 0;
+}
+
+int config_match_index::match(const char *id, uint8_t flags) const
+{
+	// Collect the ids that are prefixes of this one, then replay them per config
+	const std::string_view full(id);
+	std::vector<const entry*> found;
+	for (size_t len = 0; len <= full.size(); len++) {
+		auto [begin, end] = std::equal_range(ids.begin(), ids.end(), full.substr(0, len), [](const auto& a, const auto& b) {
+			if constexpr (std::is_same_v<std::decay_t<decltype(a)>, entry>)
+				return std::string_view(a.id.data()) < b;
+			else
+				return a < std::string_view(b.id.data());
+		});
+		for (auto it = begin; it != end; it++)
+			found.push_back(&*it);
+	}
+	std::sort(found.begin(), found.end(), [](const entry* a, const entry* b) {
+		return a->config != b->config ? a->config < b->config : a->pos < b->pos;
+	});
+
+	// Configs that an id excludes, in ascending order
+	std::vector<uint16_t> excluded;
+	for (size_t i = 0; i < found.size(); i++) {
+		const entry& ent = *found[i];
+		if (!excluded.empty() && excluded.back() == ent.config)
+			continue;
+		if (ent.flags & ID_EXCLUDED) {
+			excluded.push_back(ent.config);
+		} else if (ent.flags & flags) {
+			if ((flags & ID_ABS_PTR) && (~ent.flags & ID_ABS_PTR))
+				continue;
+			return ent.config;
+		}
+	}
+
+	for (auto [config, wildcard] : wildcards) {
+		if (std::binary_search(excluded.begin(), excluded.end(), config))
+			continue;
+		if ((wildcard & CAP_KEYBOARD) && (flags & ID_KEYBOARD))
+			return config;
+		if ((wildcard & CAP_MOUSE) && (flags & ID_MOUSE) && (~flags & ID_ABS_PTR))
+			return config;
+		if ((wildcard & CAP_MOUSE_ABS) && (flags & ID_ABS_PTR))
+			return config;
+	}
+
+	return -1;
+}
+
 int config_add_entry(struct config* config, std::string_view section, std::string_view exp)
 {
 	int idx = section.empty() ? 0 : config_access_layer(config, section);
@@ -1220,10 +1625,13 @@ config_backup::config_backup(const struct config& cfg)
 	, cmd_count(cfg.commands.size())
 	, layers(make_smart_ptr<layer_backup[]>(cfg.layers.size()))
 	, _env(cfg.cmd_env)
+	, special_keys(cfg.special_keys)
+	, features(cfg.features)
 {
 	for (size_t i = 0; i < layers.size(); i++) {
-		layers[i].keymap = make_smart_array(cfg.layers[i].keymap.mapv);
-		layers[i].chords = make_smart_array(cfg.layers[i].chords);
+		layers[i].keymap = cfg.layers[i].keymap.mapv;
+		layers[i].chords = cfg.layers[i].chords;
+		layers[i].bound = cfg.layers[i].bound;
 	}
 }
 
@@ -1232,8 +1640,9 @@ void config_backup::restore(struct keyboard* kbd)
 	::config& cfg = kbd->config;
 	for (size_t i = 0; i < layers.size(); i++) {
 		auto& layer = cfg.layers[i];
-		layer.chords.assign(layers[i].chords.begin(), layers[i].chords.end());
-		layer.keymap.mapv.assign(layers[i].keymap.begin(), layers[i].keymap.end());
+		layer.chords = layers[i].chords;
+		layer.keymap.mapv = layers[i].keymap;
+		layer.bound = layers[i].bound;
 	}
 	std::erase_if(cfg.layer_index, [&](uint16_t idx) {
 		return idx >= layers.size();
@@ -1243,17 +1652,272 @@ void config_backup::restore(struct keyboard* kbd)
 	cfg.macros.resize(macro_count);
 	cfg.commands.resize(cmd_count);
 	cfg.cmd_env = this->_env;
+	cfg.special_keys = special_keys;
+	cfg.features = features;
+}
+
+void config::update_mod_table() noexcept
+{
+	mod_table.fill(0);
+	for (size_t i = 0; i < MAX_MOD; i++) {
+		for (uint16_t code : modifiers[i]) {
+			if (code < mod_table.size())
+				mod_table[code] |= 1 << i;
+		}
+	}
+}
+
+void config::update_bound_keys() noexcept
+{
+	special_keys.reset();
+	special_keys.set(0);
+	special_keys.set(KEYD_NOOP);
+	for (size_t i = 0; i < mod_table.size(); i++) {
+		if (mod_table[i])
+			special_keys.set(i);
+	}
+
+	for (auto& layer : layers) {
+		layer.bound.reset();
+		for (auto& d : layer.keymap.mapv) {
+			if (d.id < KEYD_ENTRY_COUNT)
+				layer.bound.set(d.id);
+		}
+		for (auto& chord : layer.chords) {
+			for (uint16_t code : chord.keys) {
+				if (code < KEYD_ENTRY_COUNT)
+					special_keys.set(code);
+			}
+		}
+		if (layer.composition)
+			special_keys |= layer.bound;
+	}
+}
+
+static uint8_t descriptor_features(const struct config* cfg, const descriptor& d)
+{
+	uint8_t r = 0;
+
+	switch (d.op) {
+	case OP_OVERLOAD_TIMEOUT:
+	case OP_OVERLOAD_TIMEOUT_TAP:
+	case OP_TIMEOUT:
+		r |= FEATURE_PENDING;
+		break;
+	case OP_MACRO:
+	case OP_MACRO2:
+		r |= FEATURE_MACROS;
+		break;
+	case OP_SCROLL:
+	case OP_SCROLL_TOGGLE:
+		r |= FEATURE_SCROLL;
+		break;
+	default:
+		break;
+	}
+
+	// Follow nested actions
+	for (auto [n1, n2, act, types] : actions) {
+		if (d.op == act) {
+			for (int i = 0; i < MAX_DESCRIPTOR_ARGS; i++) {
+				if (types[i] == ARG_DESCRIPTOR)
+					r |= descriptor_features(cfg, cfg->descriptors[d.args[i].idx]);
+			}
+			break;
+		}
+	}
+
+	return r;
+}
+
+void config::update_features() noexcept
+{
+	features = 0;
+	for (auto& layer : layers) {
+		if (!layer.chords.empty())
+			features |= FEATURE_CHORDS;
+		if (layer.composition && (!layer.keymap.empty() || !layer.chords.empty()))
+			features |= FEATURE_COMPOSITES;
+		for (auto& d : layer.keymap.mapv)
+			features |= descriptor_features(this, d);
+		for (auto& chord : layer.chords)
+			features |= descriptor_features(this, chord.d);
+	}
+}
+
+void config::update_binding(struct layer& layer, const descriptor& d, const struct chord* chord) noexcept
+{
+	features |= descriptor_features(this, d);
+	if (chord) {
+		for (uint16_t code : chord->keys) {
+			if (code < KEYD_ENTRY_COUNT)
+				special_keys.set(code);
+		}
+		features |= FEATURE_CHORDS;
+	} else if (d.id < KEYD_ENTRY_COUNT) {
+		layer.bound.set(d.id);
+		if (layer.composition)
+			special_keys.set(d.id);
+	}
+	if (layer.composition)
+		features |= FEATURE_COMPOSITES;
+}
+
+void config::compile_macros() noexcept
+{
+	for (auto& macro : macros) {
+		if (macro.script.empty())
+			macro.script = macro.compile(this);
+	}
 }
 
 void config::finalize() noexcept
 {
+	update_mod_table();
+
 	for (auto& layer : layers) {
 		layer.keymap.sort();
 		// TODO: report unreachable layers
 	}
+	update_bound_keys();
+	update_features();
+	compile_macros();
+	freeze();
 	finalized = true;
 }
 
+/*
+ * Binding tables in all live arenas by content, sorted by hash. Configs
+ * parsed from shared includes often have identical layers. Each entry
+ * counts the configs referring to it and is dropped with the last one,
+ * so the registry only holds tables in use. Configs are finalized and
+ * destroyed on the main thread only, hence no locking.
+ */
+struct frozen_table {
+	uint64_t hash;
+	size_t size;
+	const std::byte* data;
+	config_arena* arena;
+	unsigned refs;
+};
+
+static std::vector<frozen_table> frozen_tables;
+
+size_t config_frozen_tables()
+{
+	return frozen_tables.size();
+}
+
+uint64_t hash_bytes(const void* data, size_t size)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 1099511628211ull;
+	return hash;
+}
+
+static auto find_table(uint64_t hash)
+{
+	return std::lower_bound(frozen_tables.begin(), frozen_tables.end(), hash, [](const frozen_table& t, uint64_t hash) {
+		return t.hash < hash;
+	});
+}
+
+static void table_unref(const frozen_ref& ref) noexcept
+{
+	auto it = find_table(ref.hash);
+	while (it->data != ref.data)
+		it++;
+	if (--it->refs)
+		return;
+
+	frozen_tables.erase(it);
+	if (--ref.arena->refs)
+		return;
+	munmap(ref.arena->base, ref.arena->size);
+	delete ref.arena;
+}
+
+void config::freeze(config_arena* src) noexcept
+{
+	auto in_src = [&](const auto& v) {
+		auto p = reinterpret_cast<const std::byte*>(v.data());
+		return src && v.frozen() && p >= src->base && p + v.size() * sizeof(v[0]) <= src->base + src->size;
+	};
+
+	size_t size = 0;
+	for (auto& layer : layers) {
+		size += in_src(layer.keymap.mapv) ? 0 : layer.keymap.mapv.size() * sizeof(descriptor);
+		size += in_src(layer.chords) ? 0 : layer.chords.size() * sizeof(chord);
+	}
+
+	// Map enough for every table, the tail is returned if some are shared
+	const size_t page = getpagesize();
+	size = (size + page - 1) / page * page;
+	config_arena* own = nullptr;
+	if (size) {
+		auto base = static_cast<std::byte*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0));
+		if (base == MAP_FAILED)
+			return;
+		own = new config_arena{base, size, 0};
+	}
+
+	std::vector<frozen_ref> used;
+	size_t packed = 0;
+	auto place = [&](auto& v) {
+		const size_t bytes = v.size() * sizeof(v[0]);
+		if (!bytes) {
+			v.clear();
+			return;
+		}
+		const uint64_t hash = hash_bytes(v.data(), bytes);
+		auto it = find_table(hash);
+		for (; it != frozen_tables.end() && it->hash == hash; it++) {
+			if (it->size == bytes && !memcmp(it->data, v.data(), bytes))
+				break;
+		}
+		if (it == frozen_tables.end() || it->hash != hash) {
+			auto arena = src;
+			auto dst = reinterpret_cast<const std::byte*>(v.data());
+			if (!in_src(v)) {
+				// Tables are only 2-aligned, as are descriptors and chords
+				arena = own;
+				memcpy(own->base + packed, dst, bytes);
+				dst = own->base + packed;
+				packed += bytes;
+			}
+			arena->refs++;
+			it = frozen_tables.insert(it, {hash, bytes, dst, arena, 0});
+		}
+		it->refs++;
+		used.push_back({hash, it->data, it->arena});
+		v.freeze(reinterpret_cast<decltype(v.data())>(it->data));
+	};
+
+	// Keymaps of all layers first, they are searched on every key event
+	for (auto& layer : layers)
+		place(layer.keymap.mapv);
+	for (auto& layer : layers)
+		place(layer.chords);
+
+	if (own) {
+		const size_t keep = (packed + page - 1) / page * page;
+		if (keep < own->size)
+			munmap(own->base + keep, own->size - keep);
+		own->size = keep;
+		if (keep)
+			mprotect(own->base, keep, PROT_READ);
+		else
+			delete own;
+	}
+
+	// Finalizing again keeps the tables still in use
+	for (auto& ref : frozen)
+		table_unref(ref);
+	frozen = std::move(used);
+}
+
 config::config()
 {
 	// Populate special layers
@@ -1274,6 +1938,8 @@ config::config()
 
 config::~config()
 {
+	for (auto& ref : frozen)
+		table_unref(ref);
 }
 
 config_backup::~config_backup()
@@ -8,10 +8,13 @@
 
 #include <limits.h>
 #include "macro.h"
+#include "keys.h"
 #include <memory>
 #include <vector>
 #include <string_view>
 #include <array>
+#include <bitset>
+#include <algorithm>
 #include "utils.hpp"
 
 #define MAX_DESCRIPTOR_ARGS	3
@@ -21,6 +24,14 @@
 #define ID_KEYBOARD	4
 #define ID_ABS_PTR	8
 
+/* Config features, used to select a specialised engine variant. */
+#define FEATURE_CHORDS		1
+#define FEATURE_PENDING		2 // overloadt(), overloadt2(), timeout()
+#define FEATURE_COMPOSITES	4
+#define FEATURE_MACROS		8 // Repeating macro()
+#define FEATURE_SCROLL		16
+#define FEATURE_ENGINE		15 // Features affecting the key engine
+
 enum class op : uint16_t {
 	OP_NULL = 0,
 	OP_KEYSEQUENCE = 1,
@@ -45,10 +56,14 @@ enum class op : uint16_t {
 	OP_MACRO,
 	OP_MACRO2,
 	OP_TIMEOUT,
+	OP_LEADER,
 
 /* Experimental */
 	OP_SCROLL_TOGGLE,
 	OP_SCROLL,
+	OP_MOUSE_MOVE,
+	OP_MOUSE_SPEED,
+	OP_MOUSE_DRAG,
 
 	OP_MAX,
 };
@@ -90,10 +105,192 @@ struct descriptor {
 
 static_assert(sizeof(descriptor) == 10);
 
+/*
+ * Array of trivially copyable objects which finalize() can move into the
+ * read-only config arena. Writing to a frozen array copies it out first;
+ * copies of a frozen array share the arena.
+ */
+template <typename T>
+class frozen_vector {
+	static_assert(std::is_trivially_copyable_v<T>);
+
+	const T* ptr = nullptr;
+	uint32_t count = 0;
+	uint32_t cap = 0; // Zero while ptr points into the arena
+
+	void release() noexcept
+	{
+		if (cap)
+			::operator delete(const_cast<T*>(ptr));
+		ptr = nullptr;
+		count = 0;
+		cap = 0;
+	}
+
+public:
+	frozen_vector() = default;
+
+	frozen_vector(const frozen_vector& rhs)
+	{
+		*this = rhs;
+	}
+
+	frozen_vector(frozen_vector&& rhs) noexcept
+	{
+		*this = std::move(rhs);
+	}
+
+	frozen_vector& operator=(const frozen_vector& rhs)
+	{
+		if (this == &rhs)
+			return *this;
+		if (rhs.frozen()) {
+			release();
+			ptr = rhs.ptr;
+			count = rhs.count;
+		} else {
+			assign(rhs.begin(), rhs.end());
+		}
+		return *this;
+	}
+
+	frozen_vector& operator=(frozen_vector&& rhs) noexcept
+	{
+		std::swap(ptr, rhs.ptr);
+		std::swap(count, rhs.count);
+		std::swap(cap, rhs.cap);
+		return *this;
+	}
+
+	~frozen_vector()
+	{
+		release();
+	}
+
+	bool frozen() const noexcept
+	{
+		return ptr && !cap;
+	}
+
+	size_t size() const noexcept
+	{
+		return count;
+	}
+
+	bool empty() const noexcept
+	{
+		return !count;
+	}
+
+	const T* data() const noexcept
+	{
+		return ptr;
+	}
+
+	const T* begin() const noexcept
+	{
+		return ptr;
+	}
+
+	const T* end() const noexcept
+	{
+		return ptr + count;
+	}
+
+	const T& operator[](size_t i) const noexcept
+	{
+		return ptr[i];
+	}
+
+	void reserve(size_t n)
+	{
+		if (n <= cap && !frozen())
+			return;
+		n = std::max<size_t>(n, count);
+		T* p = static_cast<T*>(::operator new(n * sizeof(T)));
+		if (count)
+			memcpy(p, ptr, count * sizeof(T));
+		uint32_t size = count;
+		release();
+		ptr = p;
+		count = size;
+		cap = n;
+	}
+
+	// Writable elements, copied out of the arena if necessary
+	T* mutable_data()
+	{
+		if (frozen())
+			reserve(count);
+		return const_cast<T*>(ptr);
+	}
+
+	void insert(size_t pos, const T& value)
+	{
+		if (count == cap || frozen())
+			reserve(std::max<size_t>(count * 2, 4));
+		T* p = const_cast<T*>(ptr);
+		memmove(p + pos + 1, p + pos, (count - pos) * sizeof(T));
+		p[pos] = value;
+		count++;
+	}
+
+	void push_back(const T& value)
+	{
+		insert(count, value);
+	}
+
+	// Shrinking never needs a copy
+	void truncate(size_t n) noexcept
+	{
+		count = std::min<size_t>(n, count);
+	}
+
+	void assign(const T* first, const T* last)
+	{
+		size_t n = last - first;
+		if (n > cap || frozen()) {
+			release();
+			if (n)
+				reserve(n);
+		}
+		if (n)
+			memcpy(const_cast<T*>(ptr), first, n * sizeof(T));
+		count = n;
+	}
+
+	void clear() noexcept
+	{
+		release();
+	}
+
+	// Refer to an identical copy in an arena from now on
+	void freeze(const T* frozen) noexcept
+	{
+		uint32_t size = count;
+		release();
+		if (size) {
+			ptr = frozen;
+			count = size;
+		}
+	}
+
+	// Refer to n elements in an arena from now on
+	void freeze(const T* frozen, size_t n) noexcept
+	{
+		release();
+		if (n) {
+			ptr = frozen;
+			count = n;
+		}
+	}
+};
+
 // Experimental flat map with deferred sorting for layer keymap descriptors
 struct descriptor_map {
-	std::vector<descriptor> mapv; // Should be empty by default
+	frozen_vector<descriptor> mapv; // Should be empty by default
 
+	// Unsorted bindings are only appended; this also drops replaced ones
 	void sort();
 	void set(const descriptor& copy, bool sorted);
 	const descriptor& operator[](const descriptor&) const;
@@ -101,7 +298,7 @@ struct descriptor_map {
 	bool empty() const { return mapv.empty(); }
 };
 
-static_assert(sizeof(descriptor_map) == sizeof(std::vector<char>));
+static_assert(sizeof(descriptor_map) == 16);
 
 struct chord {
 	std::array<uint16_t, 8> keys;
@@ -117,9 +314,12 @@ static_assert(sizeof(chord) == 26);
 struct layer {
 	const_string name;
 	descriptor_map keymap;
-	std::vector<chord> chords;
+	frozen_vector<chord> chords;
 	smart_ptr<uint16_t[]> composition;
 
+	// Keys with any binding in this layer (see config::update_bound_keys)
+	std::bitset<KEYD_ENTRY_COUNT> bound;
+
 	size_t size() const
 	{
 		return composition.size();
@@ -174,24 +374,138 @@ struct alias_list {
 	smart_ptr<alias[]> list;
 };
 
+/*
+ * Aho-Corasick automaton over typed characters (key code, shifted or
+ * not), compiled from the [abbreviations] section. Transitions are
+ * stored densely so every output key press advances it in O(1).
+ */
+struct abbrev_automaton {
+	std::array<uint8_t, KEYD_ENTRY_COUNT * 2> column{}; // Symbol -> column, 0 for any other key
+	uint32_t ncols = 1;
+	std::vector<uint32_t> next; // Indexed by state * ncols + column
+	std::vector<uint16_t> match; // Macro index + 1 of the longest abbreviation ending in a state
+
+	bool empty() const
+	{
+		return next.empty();
+	}
+
+	static uint16_t symbol(uint16_t code, bool shift)
+	{
+		return code + (shift ? KEYD_ENTRY_COUNT : 0);
+	}
+
+	uint32_t step(uint32_t state, uint16_t symbol) const
+	{
+		return next[state * ncols + column[symbol]];
+	}
+};
+
+/*
+ * Leader key sequences from the [leader] section. The children of
+ * each node are stored contiguously, sorted by key code.
+ */
+struct leader_trie {
+	struct node {
+		uint32_t first; // First edge
+		uint32_t count;
+		struct descriptor d; // Action of the sequence ending here, if any
+	};
+
+	struct edge {
+		uint16_t code;
+		uint32_t node;
+	};
+
+	std::vector<node> nodes; // The root comes first
+	std::vector<edge> edges;
+
+	// Returns 0 if the sequence can't continue with the key
+	uint32_t step(uint32_t node, uint16_t code) const
+	{
+		auto begin = edges.begin() + nodes[node].first;
+		auto end = begin + nodes[node].count;
+		auto it = std::lower_bound(begin, end, code, [](const edge& e, uint16_t code) {
+			return e.code < code;
+		});
+		return it != end && it->code == code ? it->node : 0;
+	}
+};
+
+/*
+ * Read-only block of layer bindings packed by config::freeze(). Tables
+ * already frozen by another config are not packed again but shared, so
+ * a block is freed once none of its tables is referenced any more.
+ */
+struct config_arena {
+	std::byte* base;
+	size_t size;
+	unsigned refs; // Tables still referenced
+};
+
+/* A table in an arena which a config refers to. */
+struct frozen_ref {
+	uint64_t hash;
+	const std::byte* data;
+	config_arena* arena;
+};
+
+/* Number of tables shared between configs, for tests. */
+size_t config_frozen_tables();
+
+/* FNV-1a, for content addressing. */
+uint64_t hash_bytes(const void* data, size_t size);
+
 struct config {
 	std::vector<layer> layers;
 	std::vector<uint16_t> layer_index;
 	std::array<smart_ptr<uint16_t[]>, 8> modifiers;
 
-	bool is_mod(size_t i, uint16_t id) {
-		for (auto& mod : modifiers[i]) {
-			if (mod == id)
-				return true;
-		}
-		return false;
+	/* Modifier mask of every key code, derived from modifiers. */
+	std::array<uint8_t, KEYD_ENTRY_COUNT> mod_table{};
+
+	uint8_t what_mods(uint16_t id) const
+	{
+		return id < mod_table.size() ? mod_table[id] : 0;
 	}
 
+	bool is_mod(size_t i, uint16_t id) const
+	{
+		return (what_mods(id) >> i) & 1;
+	}
+
+	void update_mod_table() noexcept;
+
+	/*
+	 * Keys that can never bypass the engine regardless of the active
+	 * layers: modifiers, chord keys and keys bound in composite layers.
+	 */
+	std::bitset<KEYD_ENTRY_COUNT> special_keys;
+
+	void update_bound_keys() noexcept;
+
+	uint8_t features = -1;
+
+	void update_features() noexcept;
+
+	/*
+	 * Account for a binding added to a layer after finalize(). Bindings
+	 * only accumulate until the next reset, so this may leave features
+	 * a superset of what update_features() finds.
+	 */
+	void update_binding(struct layer& layer, const descriptor& d, const struct chord* chord = nullptr) noexcept;
+
 	/* Auxiliary descriptors used by layer bindings. */
 	std::vector<descriptor> descriptors;
 	std::vector<macro> macros;
 	std::vector<ucmd> commands;
 
+	/* Lower macros that don't have a script yet (see macro::compile). */
+	void compile_macros() noexcept;
+
+	abbrev_automaton abbrevs;
+	leader_trie leader;
+
 	smart_ptr<alias_list[]> aliases;
 	smart_ptr<env_pack> cmd_env;
 
@@ -203,6 +517,12 @@ struct config {
 	int64_t oneshot_timeout = 0;
 
 	int64_t overload_tap_timeout = 0;
+	int64_t overload_streak_timeout = 0;
+
+	int64_t leader_timeout = 1000;
+
+	int64_t mouse_accel_time = 600; // Time to reach full speed
+	int64_t mouse_initial_speed = 20; // Percentage of full speed
 
 	int64_t chord_interkey_timeout = 50;
 	int64_t chord_hold_timeout = 0;
@@ -221,6 +541,14 @@ struct config {
 	const_string default_layout;
 	const_string pathstr;
 
+	/*
+	 * Tables holding the layer keymaps and chords since finalize(), so
+	 * that key lookups touch as few pages as possible.
+	 */
+	std::vector<frozen_ref> frozen;
+
+	// Tables already inside src (e.g. a mapped image) are shared in place
+	void freeze(config_arena* src = nullptr) noexcept;
 	void finalize() noexcept;
 
 	config();
@@ -231,8 +559,10 @@ struct config {
 
 struct config_backup {
 	struct layer_backup {
-		smart_ptr<descriptor[]> keymap;
-		smart_ptr<chord[]> chords;
+		// Frozen bindings are shared with the config
+		frozen_vector<descriptor> keymap;
+		frozen_vector<chord> chords;
+		std::bitset<KEYD_ENTRY_COUNT> bound;
 	};
 
 	// These are append-only
@@ -242,6 +572,9 @@ struct config_backup {
 	// These ones are nasty
 	smart_ptr<layer_backup[]> layers;
 	smart_ptr<env_pack> _env;
+	// Derived state, restored as is rather than recomputed
+	std::bitset<KEYD_ENTRY_COUNT> special_keys;
+	uint8_t features;
 
 	explicit config_backup(const struct config& cfg);
 	~config_backup();
@@ -249,9 +582,61 @@ struct config_backup {
 	void restore(struct keyboard* kbd);
 };
 
-bool config_parse(struct config *config, const char *path);
+/*
+ * Files read by config_parse(), split into lines. A file included more
+ * than once is read once. Callers writing images keep it as the list of
+ * sources; it is not meant to be shared between configs.
+ */
+struct ini_cache {
+	struct file;
+	std::vector<std::unique_ptr<file>> files;
+
+	ini_cache();
+	ini_cache(const ini_cache&) = delete;
+	ini_cache& operator=(const ini_cache&) = delete;
+	~ini_cache();
+
+	const char* path(size_t idx) const;
+	std::string_view data(size_t idx) const; // Contents as parsed, empty if missing
+};
+
+bool config_parse(struct config *config, const char *path, struct ini_cache *cache = nullptr);
+
+/*
+ * Binary images of parsed configs (see image.cpp). Loading fails if the
+ * image is missing or corrupt, or if any file it was parsed from has
+ * changed since.
+ */
+bool config_write_image(const struct config *config, const struct ini_cache& sources, const char *path);
+bool config_load_image(struct config *config, const char *path);
 int config_add_entry(struct config *config, std::string_view, std::string_view);
 
 int config_check_match(struct config *config, const char *id, uint8_t flags);
 
+/*
+ * The [ids] of a list of configs, sorted by id. match() picks the same
+ * config as running config_check_match() on each one and keeping the
+ * first of the highest rank, but only visits ids that are prefixes of
+ * the device id.
+ */
+struct config_match_index {
+	struct entry {
+		std::array<char, 23> id;
+		uint16_t config;
+		uint16_t pos; // Position in config::ids
+		uint8_t flags;
+	};
+
+	std::vector<entry> ids;
+	std::vector<std::pair<uint16_t, uint8_t>> wildcards; // Config and its wildcard caps
+	uint16_t count = 0;
+
+	// Add the next config
+	void add(const struct config *config);
+	void clear();
+
+	// Returns the index of the matching config, or -1
+	int match(const char *id, uint8_t flags) const;
+};
+
 #endif
@@ -2,6 +2,7 @@
 #include "log.h"
 #include <bitset>
 #include <utility>
+#include <deque>
 #include "concat.hpp"
 
 #ifndef CONFIG_DIR
@@ -9,12 +10,23 @@
 #endif
 
 static int ipcfd = -1;
+static int spawnfd = -1;
 static struct vkbd* vkbd;
 static std::vector<std::unique_ptr<keyboard>> configs;
+static config_match_index config_index; // Rebuilt by load_configs()
 extern std::array<device, 128> device_table;
 
 static std::bitset<KEY_CNT> keystate{};
 
+/* Macros received over IPC, played out one after another. */
+struct ipc_macro {
+	::macro macro;
+	macro_task task;
+};
+
+static std::deque<std::unique_ptr<ipc_macro>> ipc_macros;
+static int64_t ipc_macro_time; // When to resume the first one
+
 void* aux_ss_head = nullptr;
 size_t aux_ss_count = 0;
 size_t aux_ss_size = 0;
@@ -70,6 +82,8 @@ static struct keyboard *active_kbd = NULL;
 
 static void cleanup()
 {
+	spawn_report();
+
 	for (auto& dev : device_table) {
 		if (dev.fd > 0) {
 			if (auto kbd = (struct keyboard*)dev.data) {
@@ -103,6 +117,20 @@ static void send_key(uint16_t code, uint8_t state)
 	vkbd_send_key(vkbd, code, state);
 }
 
+static void send_keys(const struct key_event *events, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (events[i].code < keystate.size())
+			keystate[events[i].code] = events[i].pressed;
+	}
+	vkbd_send_keys(vkbd, events, n);
+}
+
+static void mouse_move(int x, int y)
+{
+	vkbd_mouse_move(vkbd, x, y);
+}
+
 static void add_listener(::listener con)
 {
 	struct timeval tv;
@@ -210,40 +238,43 @@ static void load_configs()
 
 		auto name = concat(CONFIG_DIR "/", dirent->d_name);
 		if (name.get().ends_with(".conf") && !name.get().ends_with(".old.conf")) {
-			keyd_log("CONFIG: parsing b{%s}\n", name.c_str());
-
+			// Prefer an up-to-date image written by `keyd compile`
 			auto kbd = std::make_unique<keyboard>();
-			if (config_parse(&kbd->config, name.c_str())) {
+			auto img = concat(name.get(), ".img");
+			bool loaded = config_load_image(&kbd->config, img.c_str());
+			if (loaded) {
+				keyd_log("CONFIG: loaded b{%s}\n", img.c_str());
+			} else {
+				keyd_log("CONFIG: parsing b{%s}\n", name.c_str());
+				kbd = std::make_unique<keyboard>();
+				loaded = config_parse(&kbd->config, name.c_str());
+			}
+
+			if (loaded) {
 				kbd->output = {
 					.send_key = send_key,
 					.on_layer_change = on_layer_change,
+					.send_keys = send_keys,
+					.mouse_move = mouse_move,
 				};
 				configs.emplace_back(new_keyboard(std::move(kbd)));
 			} else {
 				keyd_log("DEVICE: y{WARNING} failed to parse %s\n", name.c_str());
 			}
-
 		}
 	}
 
 	closedir(dh);
+
+	config_index.clear();
+	for (auto& kbd : configs)
+		config_index.add(&kbd->config);
 }
 
 static std::unique_ptr<keyboard>* lookup_config_ent(const char *id, uint8_t flags)
 {
-	std::unique_ptr<keyboard>* match = nullptr;
-	int rank = 0;
-
-	for (auto& kbd : configs) {
-		int r = config_check_match(&kbd->config, id, flags);
-
-		if (r > rank) {
-			match = &kbd;
-			rank = r;
-		}
-	}
-
-	return match;
+	int idx = config_index.match(id, flags);
+	return idx < 0 ? nullptr : &configs[idx];
 }
 
 static void manage_device(struct device *dev)
@@ -282,6 +313,8 @@ static void manage_device(struct device *dev)
 
 [[gnu::noinline]] static void reload(const smart_ptr<env_pack>& env) noexcept
 {
+	spawn_report();
+
 	for (auto& dev : device_table) {
 		if (dev.fd > 0) {
 			if (auto kbd = (struct keyboard*)dev.data) {
@@ -465,13 +498,15 @@ static bool handle_message(::listener& con, const smart_ptr<env_pack>& cmd_env)
 		while (msg.sz && msg.data[msg.sz-1] == '\n')
 			msg.data[--msg.sz] = 0;
 
-		::macro macro;
-		if (macro_parse(msg.data, macro, nullptr, cmd_env)) {
+		auto m = std::make_unique<ipc_macro>();
+		if (macro_parse(msg.data, m->macro, nullptr, cmd_env)) {
 			send_fail(con, "%s", errstr);
 			break;
 		}
 
-		macro_execute(send_key, macro, msg.timeout, nullptr);
+		// Played out by the event loop (see run_ipc_macros), success only means accepted
+		macro_start(m->task, send_key, send_keys, m->macro, msg.timeout, nullptr);
+		ipc_macros.emplace_back(std::move(m));
 		send_success(con);
 		break;
 	}
@@ -613,29 +648,47 @@ try {
 }
 }
 
-static int event_handler(struct event *ev)
+static void run_ipc_macros(int64_t time)
 {
-	static int64_t last_time = 0;
-	static int timeout = 0;
-	struct key_event kev = {};
+	while (!ipc_macros.empty() && time >= ipc_macro_time) {
+		if (uint64_t delay = macro_step(ipc_macros.front()->task)) {
+			ipc_macro_time = time + (delay + 999) / 1000;
+			return;
+		}
+		ipc_macros.pop_front();
+	}
+}
 
-	timeout -= ev->timestamp - last_time;
-	last_time = ev->timestamp;
+#ifdef KEYD_ALLOC_WATCH
+extern "C" const char __executable_start[];
 
-	timeout = timeout < 0 ? 0 : timeout;
+/* Log the key processing allocations made since the last call (see alloc_watch). */
+static void report_allocations()
+{
+	if (!alloc_watch::count)
+		return;
 
-	switch (ev->type) {
-	case EV_TIMEOUT:
-		if (!active_kbd)
-			return 0;
+	keyd_log("y{WARNING:} %zu allocation(s) during key processing\n", alloc_watch::count);
+	for (size_t i = 0; i < alloc_watch::nsites; i++) {
+		auto& site = alloc_watch::sites[i];
+		// Resolve with addr2line -e bin/keyd
+		keyd_log("\tin %s, called from 0x%zx\n", site.scope, size_t((const char*)site.caller - __executable_start));
+	}
+	alloc_watch::reset();
+}
+#endif
 
-		kev.code = 0;
-		kev.timestamp = ev->timestamp;
+static int event_handler(struct event *ev)
+{
+	struct key_event kev = {};
 
-		timeout = kbd_process_events(active_kbd, &kev, 1);
+	switch (ev->type) {
+	case EV_TIMEOUT:
+		// Timeouts of all keyboards are processed below
 		break;
 	case EV_DEV_EVENT:
 		if (ev->dev->data) {
+			ALLOC_WATCH("event_handler");
 			struct keyboard *kbd = (struct keyboard*)ev->dev->data;
 			active_kbd = kbd;
 			switch (ev->devev->type) {
@@ -647,7 +700,7 @@ static int event_handler(struct event *ev)
 				kev.pressed = ev->devev->pressed;
 				kev.timestamp = ev->timestamp;
 
-				timeout = kbd_process_events(kbd, &kev, 1, true);
+				kbd_process_events(kbd, &kev, 1, true);
 				break;
 			case DEV_MOUSE_MOVE:
 				if (kbd->scroll.active) {
@@ -664,8 +717,7 @@ static int event_handler(struct event *ev)
 					xticks = kbd->scroll.x / kbd->scroll.sensitivity;
 					kbd->scroll.x %= kbd->scroll.sensitivity;
 
-					vkbd_mouse_scroll(vkbd, 0, -1*yticks);
-					vkbd_mouse_scroll(vkbd, 0, xticks);
+					vkbd_mouse_scroll(vkbd, 0, xticks - yticks);
 				} else {
 					vkbd_mouse_move(vkbd, ev->devev->x, ev->devev->y);
 				}
@@ -683,7 +735,18 @@ static int event_handler(struct event *ev)
 				break;
 			default:
 				break;
+			case DEV_MOUSE_SCROLL_HI_RES:
+				// Ticks bound by a layer are driven by DEV_MOUSE_SCROLL
+				if (kbd_wheel_passthrough(kbd, ev->timestamp))
+					vkbd_mouse_scroll_hi_res(vkbd, ev->devev->x, ev->devev->y);
+				break;
 			case DEV_MOUSE_SCROLL:
+				if (kbd_wheel_passthrough(kbd, ev->timestamp)) {
+					// Sent as a whole, unless the hi-res event already was
+					if (!(ev->dev->capabilities & (ev->devev->x ? CAP_HWHEEL_HI_RES : CAP_WHEEL_HI_RES)))
+						vkbd_mouse_scroll(vkbd, ev->devev->x, ev->devev->y);
+					break;
+				}
 				while (active_kbd && (ev->devev->x || ev->devev->y)) {
 					kev.pressed = 1;
 					kev.timestamp = ev->timestamp;
@@ -700,8 +763,7 @@ static int event_handler(struct event *ev)
 					kbd_process_events(kbd, &kev, 1);
 
 					kev.pressed = 0;
-					// TODO: is it OK to just overwrite timeout?
-					timeout = kbd_process_events(kbd, &kev, 1);
+					kbd_process_events(kbd, &kev, 1);
 				}
 				break;
 			}
@@ -743,13 +805,36 @@ static int event_handler(struct event *ev)
 	case EV_FD_ACTIVITY:
 		if (ev->fd == ipcfd) {
 			handle_client(accept(ipcfd, NULL, 0));
+		} else if (ev->fd == spawnfd) {
+			spawn_reap();
 		}
 		break;
 	default:
 		break;
 	}
 
-	vkbd_flush(vkbd);
+	// Any keyboard may be due, not just the one with the latest input
+	int timeout = 0;
+	if (int64_t next = kbd_run_timeouts(configs, ev->timestamp))
+		timeout = std::max<int64_t>(next - ev->timestamp, 1);
+
+	if (!ipc_macros.empty())
+		run_ipc_macros(ev->timestamp);
+
+	{
+		ALLOC_WATCH("vkbd_flush");
+		vkbd_flush(vkbd);
+	}
+
+#ifdef KEYD_ALLOC_WATCH
+	report_allocations();
+#endif
+
+	if (!ipc_macros.empty()) {
+		int wait = std::max<int64_t>(ipc_macro_time - ev->timestamp, 1);
+		return timeout > 0 ? std::min(timeout, wait) : wait;
+	}
+
 	return timeout;
 }
 
@@ -775,6 +860,9 @@ int run_daemon(int, char *[])
 
 	evloop_add_fd(ipcfd);
 
+	spawnfd = spawn_init();
+	evloop_add_fd(spawnfd);
+
 	reload({});
 
 	atexit(cleanup);
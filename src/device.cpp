@@ -70,6 +70,13 @@ static uint8_t resolve_device_capabilities(int fd, uint32_t *num_keys, uint8_t *
 		return 0;
 	}
 
+	// relmask only covers the first 8 axes
+	uint8_t relbits[2] = {};
+	if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof relbits), relbits) < 0) {
+		perror("ioctl: ev_rel");
+		return 0;
+	}
+
 	uint8_t led_caps = 0;
 	if (ioctl(fd, EVIOCGBIT(EV_LED, 1), &led_caps) < 0) {
 		perror("ioctl: EV_LED");
@@ -89,6 +96,11 @@ static uint8_t resolve_device_capabilities(int fd, uint32_t *num_keys, uint8_t *
 	if (led_caps)
 		capabilities |= CAP_LEDS;
 
+	if (relbits[REL_WHEEL_HI_RES / 8] & (1 << REL_WHEEL_HI_RES % 8))
+		capabilities |= CAP_WHEEL_HI_RES;
+	if (relbits[REL_HWHEEL_HI_RES / 8] & (1 << REL_HWHEEL_HI_RES % 8))
+		capabilities |= CAP_HWHEEL_HI_RES;
+
 	/*
 	 * If the device can emit KEY_BRIGHTNESSUP or KEY_VOLUMEUP, we treat it as a keyboard.
 	 *
@@ -412,12 +424,18 @@ struct device_event *device_read_event(struct device *dev)
 			devev.x = 0;
 
 			break;
-//		case REL_WHEEL_HI_RES:
-//			/* TODO: implement me */
-//			return NULL;
-//		case REL_HWHEEL_HI_RES:
-//			/* TODO: implement me */
-//			return NULL;
+		case REL_WHEEL_HI_RES:
+			devev.type = DEV_MOUSE_SCROLL_HI_RES;
+			devev.y = ev.value;
+			devev.x = 0;
+
+			break;
+		case REL_HWHEEL_HI_RES:
+			devev.type = DEV_MOUSE_SCROLL_HI_RES;
+			devev.y = 0;
+			devev.x = ev.value;
+
+			break;
 		default:
 			dbg("Unrecognized EV_REL code: %d\n", ev.code);
 			return NULL;
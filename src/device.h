@@ -13,6 +13,8 @@
 #define CAP_MOUSE_ABS	0x2
 #define CAP_KEYBOARD	0x4
 #define CAP_LEDS	0x8
+#define CAP_WHEEL_HI_RES	0x10
+#define CAP_HWHEEL_HI_RES	0x20
 
 struct device {
 	/*
@@ -49,6 +51,8 @@ enum class dev_event_e : signed char {
 	/* All absolute values are relative to a resolution of 1024x1024. */
 	DEV_MOUSE_MOVE_ABS,
 	DEV_MOUSE_SCROLL,
+	/* In 1/120ths of a detent, reported alongside DEV_MOUSE_SCROLL. */
+	DEV_MOUSE_SCROLL_HI_RES,
 
 	DEV_REMOVED,
 };
@@ -1,6 +1,7 @@
 #include "keyd.h"
 
-static int aux_fd = -1;
+static std::array<int, 4> aux_fds;
+static size_t n_aux;
 
 // Expected to be initialized as zeros
 // Expected to terminate if fd 0 or -1
@@ -40,7 +41,7 @@ int evloop(int (*event_handler)(struct event* ev), bool monitor)
 	int timeout = 0;
 	int monfd;
 
-	struct pollfd pfds[device_table.size() + 3]{};
+	struct pollfd pfds[device_table.size() + aux_fds.size() + 2]{};
 
 	struct event ev{};
 
@@ -56,11 +57,14 @@ int evloop(int (*event_handler)(struct event* ev), bool monitor)
 
 	pfds[0].fd = monfd;
 	pfds[0].events = POLLIN;
-	pfds[1].fd = aux_fd;
-	pfds[1].events = POLLIN;
-	pfds[2].fd = STDOUT_FILENO;
-	pfds[2].events = 0;
-	auto pfdsd = pfds + 3;
+	pfds[1].fd = STDOUT_FILENO;
+	pfds[1].events = 0;
+	auto pfdsa = pfds + 2;
+	for (size_t i = 0; i < n_aux; i++) {
+		pfdsa[i].fd = aux_fds[i];
+		pfdsa[i].events = POLLIN;
+	}
+	auto pfdsd = pfdsa + n_aux;
 
 	while (1) {
 		int removed = 0;
@@ -82,7 +86,7 @@ int evloop(int (*event_handler)(struct event* ev), bool monitor)
 		ev.timestamp = get_time_ms();
 		elapsed = ev.timestamp - start_time;
 
-		if (pfds[2].revents) {
+		if (pfds[1].revents) {
 			// Handle pipe closure
 			break;
 		}
@@ -124,10 +128,10 @@ int evloop(int (*event_handler)(struct event* ev), bool monitor)
 			}
 		}
 
-		{
-			if (auto events = pfds[1].revents) {
+		for (size_t i = 0; i < n_aux; i++) {
+			if (auto events = pfdsa[i].revents) {
 				ev.type = events & POLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
-				ev.fd = aux_fd;
+				ev.fd = pfdsa[i].fd;
 
 				timeout = event_handler(&ev);
 			}
@@ -169,6 +173,6 @@ int evloop(int (*event_handler)(struct event* ev), bool monitor)
 
 void evloop_add_fd(int fd)
 {
-	assert(aux_fd < 0);
-	aux_fd = fd;
+	assert(n_aux < aux_fds.size());
+	aux_fds[n_aux++] = fd;
 }
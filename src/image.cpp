@@ -0,0 +1,372 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+#include "keyd.h"
+#include "concat.hpp"
+
+/*
+ * Binary config images written by `keyd compile`. An image holds a parsed
+ * config as a flat stream of counted arrays (no pointers), preceded by the
+ * files it was parsed from. Loading an image skips tokenising, name
+ * resolution and keymap sorting; it is rejected if the contents of any
+ * source file differ from what was parsed, or if it was written by a
+ * different build layout. Arrays are aligned for their type, so the layer
+ * tables are used in place from the mapped image.
+ */
+
+#define IMAGE_MAGIC	"keydimg"
+#define IMAGE_VERSION	2
+
+struct image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout; // See image_layout()
+};
+
+static uint32_t image_layout()
+{
+	uint32_t h = 5183;
+	for (uint32_t v : {sizeof(descriptor), sizeof(chord), sizeof(macro_entry), sizeof(key_event),
+			   sizeof(macro_script::mark), sizeof(alias), sizeof(dev_id), sizeof(leader_trie::node),
+			   sizeof(leader_trie::edge), size_t(KEYD_ENTRY_COUNT), size_t(OP_MAX), size_t(MACRO_MAX)})
+		h = h * 33 + v;
+	return h;
+}
+
+struct image_writer {
+	std::vector<char> buf;
+
+	template <typename T>
+	void put(const T& v)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		buf.insert(buf.end(), (const char*)&v, (const char*)&v + sizeof(T));
+	}
+
+	template <typename T>
+	void put_array(const T* p, size_t n)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		put(uint32_t(n));
+		buf.resize((buf.size() + alignof(T) - 1) & -alignof(T));
+		if (n)
+			buf.insert(buf.end(), (const char*)p, (const char*)(p + n));
+	}
+
+	template <typename R>
+	void put_array(const R& range)
+	{
+		put_array(std::data(range), std::size(range));
+	}
+
+	void put_string(std::string_view s)
+	{
+		put_array(s.data(), s.size());
+	}
+};
+
+struct image_reader {
+	std::string_view data;
+	size_t pos = 0;
+	bool ok = true;
+
+	template <typename T>
+	T get()
+	{
+		T v{};
+		if (!ok || data.size() - pos < sizeof(T)) {
+			ok = false;
+			return v;
+		}
+		memcpy((void*)&v, data.data() + pos, sizeof(T));
+		pos += sizeof(T);
+		return v;
+	}
+
+	// Elements in place (data must be aligned as the image file is)
+	template <typename T>
+	std::span<const T> get_span()
+	{
+		uint32_t n = get<uint32_t>();
+		pos = std::min((pos + alignof(T) - 1) & -alignof(T), data.size());
+		if (!ok || (data.size() - pos) / sizeof(T) < n) {
+			ok = false;
+			return {};
+		}
+		pos += n * sizeof(T);
+		return {reinterpret_cast<const T*>(data.data() + pos - n * sizeof(T)), n};
+	}
+
+	template <typename T>
+	std::vector<T> get_array()
+	{
+		auto v = get_span<T>();
+		return {v.begin(), v.end()};
+	}
+
+	// Share a layer table in place, see config::freeze()
+	template <typename T>
+	void get_array(frozen_vector<T>& dst)
+	{
+		auto v = get_span<T>();
+		dst.freeze(v.data(), v.size());
+	}
+
+	std::string_view get_string()
+	{
+		uint32_t n = get<uint32_t>();
+		if (!ok || data.size() - pos < n) {
+			ok = false;
+			return {};
+		}
+		pos += n;
+		return data.substr(pos - n, n);
+	}
+};
+
+// Size (-1 if missing) and hash of a source file as it is now
+static void hash_source(const char *path, int64_t& size, uint64_t& hash)
+{
+	struct stat st;
+	size = -1;
+	hash = 0;
+	if (stat(path, &st) < 0)
+		return;
+	size = st.st_size;
+	if (file_mapper file(open(path, O_RDONLY)); file)
+		hash = hash_bytes(file.view().data(), file.view().size());
+}
+
+static bool image_write(image_writer& w, const struct config *config, const struct ini_cache& sources)
+{
+	image_header hdr{IMAGE_MAGIC, IMAGE_VERSION, image_layout()};
+	w.put(hdr);
+
+	w.put(uint32_t(sources.files.size()));
+	for (size_t i = 0; i < sources.files.size(); i++) {
+		// The contents that were parsed, not the file as it is by now
+		auto data = sources.data(i);
+		int64_t size = data.data() ? int64_t(data.size()) : -1;
+		uint64_t hash = data.data() ? hash_bytes(data.data(), data.size()) : 0;
+		// Missing includes are recorded too, in case they appear later
+		w.put_string(sources.path(i));
+		w.put(size);
+		w.put(hash);
+	}
+
+	w.put(uint32_t(config->layers.size()));
+	for (auto& layer : config->layers) {
+		w.put_string(layer.name);
+		w.put_array(layer.keymap.mapv);
+		w.put_array(layer.chords);
+		w.put_array(layer.begin(), layer.size());
+	}
+	w.put_array(config->layer_index);
+
+	for (auto& mods : config->modifiers)
+		w.put_array(mods.get(), mods.size());
+
+	w.put_array(config->descriptors);
+
+	w.put(uint32_t(config->macros.size()));
+	for (auto& macro : config->macros) {
+		w.put_array(macro.size == 1 ? &macro.entry : macro.entries.get(), macro.size);
+		w.put_array(macro.script.events);
+		w.put_array(macro.script.marks);
+	}
+
+	w.put(uint32_t(config->commands.size()));
+	for (auto& cmd : config->commands) {
+		// Credentials only come from IPC, never from config files
+		if (cmd.env) {
+			keyd_log("%s: commands with an environment can't be compiled\n", config->pathstr.c_str());
+			return false;
+		}
+		w.put_string(cmd.cmd);
+	}
+
+	w.put(config->abbrevs.column);
+	w.put(config->abbrevs.ncols);
+	w.put_array(config->abbrevs.next);
+	w.put_array(config->abbrevs.match);
+
+	w.put_array(config->leader.nodes);
+	w.put_array(config->leader.edges);
+
+	w.put(uint32_t(config->aliases.size()));
+	for (auto& a : config->aliases) {
+		w.put_string(a.name);
+		w.put_array(a.list.get(), a.list.size());
+	}
+
+	w.put_array(config->ids);
+
+	for (int64_t v : {config->macro_timeout, config->macro_sequence_timeout, config->macro_repeat_timeout,
+			  config->oneshot_timeout, config->overload_tap_timeout, config->overload_streak_timeout,
+			  config->leader_timeout, config->mouse_accel_time, config->mouse_initial_speed,
+			  config->chord_interkey_timeout, config->chord_hold_timeout})
+		w.put(v);
+	w.put(uint8_t(config->compat));
+	w.put(config->wildcard);
+	w.put(config->layer_indicator);
+	w.put(config->disable_modifier_guard);
+	w.put_string(config->default_layout);
+	w.put_string(config->pathstr);
+	return true;
+}
+
+bool config_write_image(const struct config *config, const struct ini_cache& sources, const char *path)
+{
+	image_writer w;
+	if (!image_write(w, config, sources))
+		return false;
+
+	auto tmp = concat(path, ".tmp");
+	FILE *fh = fopen(tmp.c_str(), "w");
+	if (!fh) {
+		keyd_log("Unable to write %s: %s\n", tmp.c_str(), strerror(errno));
+		return false;
+	}
+	bool written = fwrite(w.buf.data(), 1, w.buf.size(), fh) == w.buf.size();
+	if (fclose(fh) || !written || rename(tmp.c_str(), path) < 0) {
+		keyd_log("Unable to write %s: %s\n", path, strerror(errno));
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+static bool image_read(struct config *config, std::string_view data, const char *path)
+{
+	image_reader r{data};
+
+	auto hdr = r.get<image_header>();
+	if (!r.ok || memcmp(hdr.magic, IMAGE_MAGIC, sizeof hdr.magic) || hdr.version != IMAGE_VERSION || hdr.layout != image_layout()) {
+		keyd_log("%s: image was written by another version of keyd, ignoring\n", path);
+		return false;
+	}
+
+	for (uint32_t n = r.get<uint32_t>(); r.ok && n--;) {
+		auto src = r.get_string();
+		auto size = r.get<int64_t>();
+		auto hash = r.get<uint64_t>();
+		int64_t cur_size;
+		uint64_t cur_hash;
+		hash_source(make_string(src).c_str(), cur_size, cur_hash);
+		if (r.ok && (cur_size != size || cur_hash != hash)) {
+			keyd_log("%s: %.*s has changed since, ignoring\n", path, (int)src.size(), src.data());
+			return false;
+		}
+	}
+
+	config->layers.resize(r.get<uint32_t>());
+	for (auto& layer : config->layers) {
+		layer.name = (aux_alloc(), make_string(r.get_string()));
+		r.get_array(layer.keymap.mapv);
+		r.get_array(layer.chords);
+		layer.composition = (aux_alloc(), make_smart_array(r.get_array<uint16_t>()));
+		if (!r.ok)
+			break;
+	}
+	config->layer_index = r.get_array<uint16_t>();
+
+	for (auto& mods : config->modifiers)
+		mods = (aux_alloc(), make_smart_array(r.get_array<uint16_t>()));
+
+	config->descriptors = r.get_array<descriptor>();
+
+	config->macros.resize(r.get<uint32_t>());
+	for (auto& macro : config->macros) {
+		auto entries = r.get_array<macro_entry>();
+		macro.size = entries.size();
+		if (macro.size == 1)
+			macro.entry = entries[0];
+		else
+			macro.entries = (aux_alloc(), make_buf(entries, +0));
+		macro.script.events = r.get_array<key_event>();
+		macro.script.marks = r.get_array<macro_script::mark>();
+		if (!r.ok)
+			break;
+	}
+
+	config->commands.resize(r.get<uint32_t>());
+	for (auto& cmd : config->commands) {
+		cmd.cmd = (aux_alloc(), make_string(r.get_string()));
+		if (!r.ok)
+			break;
+	}
+
+	config->abbrevs.column = r.get<decltype(config->abbrevs.column)>();
+	config->abbrevs.ncols = r.get<uint32_t>();
+	config->abbrevs.next = r.get_array<uint32_t>();
+	config->abbrevs.match = r.get_array<uint16_t>();
+
+	config->leader.nodes = r.get_array<leader_trie::node>();
+	config->leader.edges = r.get_array<leader_trie::edge>();
+
+	if (uint32_t n = r.get<uint32_t>(); r.ok && n) {
+		aux_alloc aux;
+		config->aliases = make_smart_ptr<alias_list[], false>(n);
+		for (auto& a : config->aliases) {
+			a.name = make_string(r.get_string());
+			a.list = make_smart_array(r.get_array<alias>());
+		}
+	}
+
+	config->ids = r.get_array<dev_id>();
+
+	for (int64_t* v : {&config->macro_timeout, &config->macro_sequence_timeout, &config->macro_repeat_timeout,
+			   &config->oneshot_timeout, &config->overload_tap_timeout, &config->overload_streak_timeout,
+			   &config->leader_timeout, &config->mouse_accel_time, &config->mouse_initial_speed,
+			   &config->chord_interkey_timeout, &config->chord_hold_timeout})
+		*v = r.get<int64_t>();
+	config->compat = r.get<uint8_t>();
+	config->wildcard = r.get<uint8_t>();
+	config->layer_indicator = r.get<uint8_t>();
+	config->disable_modifier_guard = r.get<uint8_t>();
+	config->default_layout = (aux_alloc(), make_string(r.get_string()));
+	config->pathstr = (aux_alloc(), make_string(r.get_string()));
+
+	if (!r.ok || r.pos != r.data.size()) {
+		keyd_log("%s: image is truncated or corrupt, ignoring\n", path);
+		return false;
+	}
+
+	config->update_mod_table();
+	return true;
+}
+
+bool config_load_image(struct config *config, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	// The mapping becomes the arena of the layer tables read in place
+	struct stat st;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+
+	auto arena = new config_arena{static_cast<std::byte*>(base), size_t(st.st_size), 0};
+	bool ok = image_read(config, {static_cast<const char*>(base), arena->size}, path);
+	if (ok)
+		config->freeze(arena);
+	else
+		config->layers.clear(); // Don't leave tables pointing into the mapping
+
+	// Rejected, or no table of it is used
+	if (!arena->refs) {
+		munmap(arena->base, arena->size);
+		delete arena;
+	}
+
+	return ok;
+}
@@ -7,7 +7,9 @@
 #include "keyd.h"
 #include <algorithm>
 
+template <uint8_t F = FEATURE_ENGINE>
 static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, int64_t time);
+static void refeed_queue(struct keyboard *kbd, struct key_event_queue& queue, size_t offset);
 
 /*
  * Here be tiny dragons.
@@ -20,6 +22,28 @@ static int64_t get_time()
 	return time++;
 }
 
+void key_event_queue::reserve(uint32_t n)
+{
+	while (cap < n)
+		grow();
+}
+
+void key_event_queue::grow()
+{
+	const uint32_t new_cap = cap ? cap * 2 : 32;
+	auto new_buf = std::make_unique_for_overwrite<key_event[]>(new_cap);
+
+	// Preserve absolute positions of pinned and queued events
+	for (uint32_t i = pin; i != tail; i++)
+		new_buf[i & (new_cap - 1)] = buf[i & (cap - 1)];
+
+	if (cap)
+		dbg("event queue grown to %u entries, %u events held", new_cap, tail - pin);
+
+	buf = std::move(new_buf);
+	cap = new_cap;
+}
+
 static int cache_set(struct keyboard *kbd, uint16_t code, struct cache_entry *ent)
 {
 	size_t i;
@@ -57,14 +81,79 @@ static struct cache_entry *cache_get(struct keyboard *kbd, uint16_t code)
 	return NULL;
 }
 
+static uint8_t what_mods(struct keyboard* kbd, uint16_t code);
+
+static void flush_output(struct keyboard *kbd)
+{
+	if (!kbd->output_sz)
+		return;
+
+	if (kbd->output.send_keys) {
+		kbd->output.send_keys(kbd->output_buf.data(), kbd->output_sz);
+	} else {
+		for (size_t i = 0; i < kbd->output_sz; i++)
+			kbd->output.send_key(kbd->output_buf[i].code, kbd->output_buf[i].pressed);
+	}
+
+	kbd->output_sz = 0;
+	kbd->output_mark = 0;
+}
+
+static void output_key(struct keyboard *kbd, uint16_t code, uint8_t pressed)
+{
+	/*
+	 * A modifier release immediately followed by its re-press within
+	 * the same input event is unobservable (no other key is sent in
+	 * between), so both events are dropped. Adjacent down/up pairs are
+	 * kept since a lone modifier tap has a meaning of its own.
+	 */
+	if (pressed && kbd->output_sz > kbd->output_mark) {
+		const struct key_event& last = kbd->output_buf[kbd->output_sz - 1];
+		if (last.code == code && !last.pressed && what_mods(kbd, code)) {
+			kbd->output_sz--;
+			return;
+		}
+	}
+
+	if (kbd->output_sz == kbd->output_buf.size())
+		flush_output(kbd);
+
+	struct key_event& ev = kbd->output_buf[kbd->output_sz++];
+	ev.code = code;
+	ev.pressed = pressed;
+	ev.timestamp = 0;
+}
+
 static void reset_keystate(struct keyboard *kbd)
 {
 	for (size_t i = 0; i < kbd->keystate.size(); i++) {
 		if (kbd->keystate[i]) {
-			kbd->output.send_key(i, 0);
+			output_key(kbd, i, 0);
 			kbd->keystate[i] = 0;
 		}
 	}
+
+	kbd->fake_mods = 0;
+	kbd->mods_dirty = true;
+}
+
+/* Feed a typed character to the abbreviation automaton. */
+static void step_abbrevs(struct keyboard *kbd, uint16_t code)
+{
+	const auto& ac = kbd->config.abbrevs;
+
+	// Shortcuts don't type anything
+	if (kbd->applied_mods & ~(1 << MOD_SHIFT)) {
+		kbd->abbrev_state = 0;
+		return;
+	}
+
+	const uint16_t sym = abbrev_automaton::symbol(code, kbd->applied_mods != 0);
+	kbd->abbrev_state = ac.step(kbd->abbrev_state, sym);
+	if (uint16_t match = ac.match[kbd->abbrev_state]) {
+		kbd->abbrev_match = match;
+		kbd->abbrev_state = 0;
+	}
 }
 
 static void send_key(struct keyboard *kbd, uint16_t code, uint8_t pressed)
@@ -81,7 +170,16 @@ static void send_key(struct keyboard *kbd, uint16_t code, uint8_t pressed)
 
 	if (kbd->keystate[code] != pressed) {
 		kbd->keystate[code] = pressed;
-		kbd->output.send_key(code, pressed);
+		if (size_t(code - KEYD_FAKEMOD) < MAX_MOD) {
+			uint8_t mask = 1 << (code - KEYD_FAKEMOD);
+			kbd->fake_mods = pressed ? kbd->fake_mods | mask : kbd->fake_mods & ~mask;
+			kbd->mods_dirty = true;
+		} else if (kbd->config.what_mods(code)) {
+			kbd->mods_dirty = true;
+		} else if (pressed && !kbd->config.abbrevs.empty()) {
+			step_abbrevs(kbd, code);
+		}
+		output_key(kbd, code, pressed);
 	}
 }
 
@@ -112,6 +210,13 @@ static void clear_mod(struct keyboard *kbd, uint16_t code)
 
 static void set_mods(struct keyboard *kbd, uint8_t mods)
 {
+	/*
+	 * The result only depends on mods and on the state of modifier keys,
+	 * so repeating the last call without intervening changes is a no-op.
+	 */
+	if (!kbd->mods_dirty && mods == kbd->applied_mods)
+		return;
+
 	for (size_t i = 0; i < MAX_MOD; i++) {
 		uint8_t mask = 1 << i;
 		auto& codes = kbd->config.modifiers[i];
@@ -134,11 +239,15 @@ static void set_mods(struct keyboard *kbd, uint8_t mods)
 		} else {
 			// Clear all possible keys for this mod
 			kbd->keystate[KEYD_FAKEMOD + i] = 0;
+			kbd->fake_mods &= ~mask;
 			for (uint16_t code : codes)
 				if (kbd->keystate[code])
 					clear_mod(kbd, code);
 		}
 	}
+
+	kbd->applied_mods = mods;
+	kbd->mods_dirty = false;
 }
 
 static void update_mods(struct keyboard *kbd, [[maybe_unused]] int excl, uint8_t mods, uint8_t wildcard = -1, uint16_t code = -1)
@@ -150,7 +259,9 @@ static void update_mods(struct keyboard *kbd, [[maybe_unused]] int excl, uint8_t
 		wildcard = -1;
 
 	uint8_t addm = 0;
-	for (size_t i = 1; i <= MAX_MOD; i++) {
+	if (!excluded_layer)
+		mods |= kbd->layer_mods;
+	else for (size_t i = 1; i <= MAX_MOD; i++) {
 		struct layer *layer = &kbd->config.layers[i];
 		size_t excluded = 0;
 
@@ -188,33 +299,90 @@ static void update_mods(struct keyboard *kbd, [[maybe_unused]] int excl, uint8_t
 
 static uint8_t get_mods(struct keyboard* kbd)
 {
-	uint8_t mods = 0;
+	return kbd->layer_mods | kbd->fake_mods;
+}
 
-	for (size_t i = 0; i < MAX_MOD; i++) {
-		uint8_t mask = 1 << i;
-		if (kbd->layer_state[i + 1].active())
-			mods |= mask;
-		if (kbd->keystate[KEYD_FAKEMOD + i])
-			mods |= mask;
-	}
+static uint8_t what_mods(struct keyboard* kbd, uint16_t code)
+{
+	return kbd->config.what_mods(code);
+}
+
+/*
+ * Macros are played out in order as resumable tasks, so that delays
+ * don't block the event loop (or other keys).
+ */
+static void run_macros(struct keyboard *kbd, int64_t time)
+{
+	// Macros write directly, preserve ordering
+	flush_output(kbd);
+
+	while (true) {
+		auto& task = kbd->macro_task;
+
+		if (!task.active()) {
+			if (kbd->macro_queue.empty())
+				return;
+			kbd->macro_task_idx = kbd->macro_queue.pop();
+			macro_start(task, kbd->output.send_key, kbd->output.send_keys, kbd->config.macros[kbd->macro_task_idx],
+				    kbd->config.macro_sequence_timeout, &kbd->config);
+		} else if (kbd->macro_task_idx < kbd->config.macros.size()) {
+			// Bindings may have reallocated macros meanwhile
+			task.macro = &kbd->config.macros[kbd->macro_task_idx];
+		} else {
+			task.macro = nullptr;
+			continue;
+		}
 
-	return mods;
+		if (uint64_t delay = macro_step(task)) {
+			kbd->macro_task_time = time + (delay + 999) / 1000;
+			kbd->timers.schedule(TIMER_MACRO_TASK, kbd->macro_task_time);
+			return;
+		}
+	}
 }
 
-static uint8_t what_mods(struct keyboard* kbd, uint16_t code)
+/*
+ * Integrates mouse keys motion up to `time` and emits it as a single
+ * frame. Fractions of a pixel are carried over to the next step, and the
+ * speed ramps up quadratically over mouse_accel_time.
+ */
+static void update_mouse(struct keyboard *kbd, int64_t time)
 {
-	uint8_t mods = 0;
+	auto& m = kbd->mouse;
 
-	for (size_t i = 0; i < kbd->config.modifiers.size(); i++) {
-		uint8_t mask = 1 << i;
-		if (kbd->config.is_mod(i, code))
-			mods |= mask;
+	if (time > m.last) {
+		const auto& cfg = kbd->config;
+		double f = 1;
+
+		if (cfg.mouse_accel_time > 0) {
+			const double u = std::min(1.0, double(time - m.start) / cfg.mouse_accel_time);
+			const double s0 = cfg.mouse_initial_speed / 100.0;
+			f = s0 + (1 - s0) * u * u;
+		}
+		if (m.speed)
+			f = f * m.speed / 100;
+
+		const double dt = (time - m.last) / 1000.0 * f;
+		m.x += m.vx * dt;
+		m.y += m.vy * dt;
+		m.last = time;
+
+		const int dx = m.x;
+		const int dy = m.y;
+		m.x -= dx;
+		m.y -= dy;
+
+		if ((dx || dy) && kbd->output.mouse_move) {
+			// Buttons (e.g. mousedrag) must arrive first
+			flush_output(kbd);
+			kbd->output.mouse_move(dx, dy);
+		}
 	}
 
-	return mods;
+	kbd->timers.schedule(TIMER_MOUSE, time + 1);
 }
 
-static uint64_t execute_macro(struct keyboard *kbd, int16_t dl, uint16_t idx, uint16_t orig_code)
+static void execute_macro(struct keyboard *kbd, int16_t dl, uint16_t idx, uint16_t orig_code, int64_t time)
 {
 	auto& macro = kbd->config.macros[idx & INT16_MAX];
 	/* Minimize redundant modifier strokes for simple key sequences. */
@@ -227,14 +395,19 @@ static uint64_t execute_macro(struct keyboard *kbd, int16_t dl, uint16_t idx, ui
 		update_mods(kbd, dl, macro[0].mods.mods, macro[0].mods.wildc);
 		send_key(kbd, code, 1);
 		send_key(kbd, code, 0);
-		return 0;
 	} else {
 		// Completely disable mods if no wildcard is set
 		update_mods(kbd, dl, 0, (kbd->config.compat || idx & 0x8000) ? 0xff : 0);
-		return macro_execute(kbd->output.send_key, macro, kbd->config.macro_sequence_timeout, &kbd->config) / 1000;
+		if (!kbd->macro_queue.push(idx & INT16_MAX)) {
+			keyd_log("y{WARNING} too many queued macros, dropping one\n");
+			return;
+		}
+		if (!kbd->macro_task.active())
+			run_macros(kbd, time);
 	}
 }
 
+template <uint8_t F>
 static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descriptor *d, int16_t* dl)
 {
 	d->op = OP_NULL;
@@ -267,33 +440,37 @@ static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descri
 	size_t max = 0;
 	size_t conflicts = 0;
 
-	for (size_t i = 0; i < kbd->config.layers.size(); i++) {
-		struct layer *layer = &kbd->config.layers[i];
-
-		if (kbd->layer_state[i].active()) {
-			const auto act_ts = kbd->layer_state[i].activation_time;
-			if (i > 0)
-				kbd->active_layers[set++] = i;
-			if (act_ts < maxts)
-				continue;
-			if (auto match = layer->keymap[desc]) {
-				if (maxts < act_ts)
-					conflicts = 0;
-				maxts = act_ts;
-				max = 1;
-				// Check for conflicting matches, actual conflict discards both
-				// Deep comparison is performed to verify conflict
-				// To avoid some legitimate cases with identical ops
-				if (!conflicts || !d->equals(&kbd->config, match))
-					conflicts++;
-				*d = match;
-				*dl = i;
-			}
+	auto match_layer = [&](size_t i) {
+		const auto act_ts = kbd->layer_state[i].activation_time;
+		if (i > 0)
+			kbd->active_layers[set++] = i;
+		if (act_ts < maxts)
+			return;
+		if (auto match = kbd->config.layers[i].keymap[desc]) {
+			if (maxts < act_ts)
+				conflicts = 0;
+			maxts = act_ts;
+			max = 1;
+			// Check for conflicting matches, actual conflict discards both
+			// Deep comparison is performed to verify conflict
+			// To avoid some legitimate cases with identical ops
+			if (!conflicts || !d->equals(&kbd->config, match))
+				conflicts++;
+			*d = match;
+			*dl = i;
 		}
+	};
+
+	// Active layers in index order: the mask first, then any past 63
+	for (uint64_t mask = kbd->layer_mask; mask; mask &= mask - 1)
+		match_layer(std::countr_zero(mask));
+	for (size_t i = 64; i < kbd->config.layers.size(); i++) {
+		if (kbd->layer_state[i].active())
+			match_layer(i);
 	}
 
 	/* Scan for any composite matches (which take precedence). */
-	for (size_t i = MAX_MOD + 1; i < kbd->config.layers.size(); i++) {
+	if constexpr (F & FEATURE_COMPOSITES) for (size_t i = MAX_MOD + 1; i < kbd->config.layers.size(); i++) {
 		if (set <= 1) [[likely]]
 			break;
 		// Optimization: don't access uninteresting layers
@@ -317,12 +494,9 @@ static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descri
 
 	if (d->op == OP_NULL || conflicts > 1) {
 		// If key is a registered modifier, fallback to setting layer by default
-		for (size_t i = 0; i < MAX_MOD; i++) {
-			if (kbd->config.is_mod(i, code)) {
-				desc.op = OP_LAYER;
-				desc.args[0].idx = i + 1;
-				break;
-			}
+		if (uint8_t mods = what_mods(kbd, code)) {
+			desc.op = OP_LAYER;
+			desc.args[0].idx = std::countr_zero(mods) + 1;
 		}
 
 		*d = desc;
@@ -330,6 +504,27 @@ static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descri
 	}
 }
 
+static void update_layer_set(struct keyboard *kbd, size_t idx)
+{
+	kbd->transparent_dirty = true;
+	if (idx < 64) {
+		const uint64_t bit = uint64_t(1) << idx;
+		if (kbd->layer_state[idx].active())
+			kbd->layer_mask |= bit;
+		else
+			kbd->layer_mask &= ~bit;
+	}
+
+	if (idx - 1 >= MAX_MOD)
+		return;
+
+	uint8_t mask = 1 << (idx - 1);
+	if (kbd->layer_state[idx].active())
+		kbd->layer_mods |= mask;
+	else
+		kbd->layer_mods &= ~mask;
+}
+
 static void activate_layer(struct keyboard *kbd, uint16_t code, int idx);
 
 static void deactivate_layer(struct keyboard *kbd, int idx)
@@ -344,10 +539,12 @@ static void deactivate_layer(struct keyboard *kbd, int idx)
 	if (layer.name) {
 		dbg("Deactivating layer %s", layer.name.c_str());
 		kbd->layer_state[idx].active_s--;
+		update_layer_set(kbd, idx);
 	} else {
 		for (uint16_t i : layer) {
 			dbg("Deactivating layer %s", kbd->config.layers[i].name.c_str());
 			kbd->layer_state[i].active_s--;
+			update_layer_set(kbd, i);
 		}
 	}
 
@@ -376,6 +573,7 @@ static void activate_layer(struct keyboard *kbd, uint16_t code, int idx)
 		kbd->layer_state[idx].active_s++;
 		if (kbd->layer_state[idx].active())
 			kbd->layer_state[idx].activation_time = ts;
+		update_layer_set(kbd, idx);
 	} else {
 		for (uint16_t i : layer) {
 			dbg("Activating layer %s", kbd->config.layers[i].name.c_str());
@@ -383,6 +581,7 @@ static void activate_layer(struct keyboard *kbd, uint16_t code, int idx)
 			state.active_s++;
 			if (state.active())
 				state.activation_time = ts;
+			update_layer_set(kbd, i);
 		}
 	}
 
@@ -397,16 +596,16 @@ static void activate_layer(struct keyboard *kbd, uint16_t code, int idx)
  *  1 on partial match
  *  2 on exact match
  */
-static int chord_event_match(struct chord *chord, struct key_event *events, size_t nevents)
+static int chord_event_match(const struct chord *chord, const struct key_event_queue& events)
 {
 	size_t i, j;
 	size_t n = 0;
 	size_t npressed = 0;
 
-	if (!nevents)
+	if (events.empty())
 		return 0;
 
-	for (i = 0; i < nevents; i++)
+	for (i = 0; i < events.size(); i++)
 		if (events[i].pressed) {
 			int found = 0;
 
@@ -432,13 +631,12 @@ static void enqueue_chord_event(struct keyboard *kbd, uint16_t code, uint8_t pre
 	if (!code)
 		return;
 
-	assert(kbd->chord.queue_sz < ARRAY_SIZE(kbd->chord.queue));
-
-	kbd->chord.queue[kbd->chord.queue_sz].code = code;
-	kbd->chord.queue[kbd->chord.queue_sz].pressed = pressed;
-	kbd->chord.queue[kbd->chord.queue_sz].timestamp = time;
+	struct key_event ev = {};
+	ev.code = code;
+	ev.pressed = pressed;
+	ev.timestamp = time;
 
-	kbd->chord.queue_sz++;
+	kbd->queues.chord.push(ev);
 }
 
 /* Returns:
@@ -465,9 +663,7 @@ static int check_chord_match(struct keyboard *kbd, const struct chord **chord, i
 		}
 
 		for (size_t i = 0; i < layer->chords.size(); i++) {
-			int ret = chord_event_match(&layer->chords[i],
-						    kbd->chord.queue,
-						    kbd->chord.queue_sz);
+			int ret = chord_event_match(&layer->chords[i], kbd->queues.chord);
 
 			if (ret == 2 &&
 				maxts <= int64_t(kbd->layer_state[idx].activation_time)) {
@@ -490,43 +686,6 @@ static int check_chord_match(struct keyboard *kbd, const struct chord **chord, i
 		return 0;
 }
 
-void execute_command(ucmd& cmd)
-{
-	dbg("executing command: %s", cmd.cmd.c_str());
-
-	if (fork()) {
-		return;
-	}
-
-	if (cmd.env && cmd.env->gid && setgid(cmd.env->gid) < 0) {
-		perror("setgid");
-		exit(-1);
-	}
-	if (cmd.env && cmd.env->uid && setuid(cmd.env->uid) < 0) {
-		perror("setuid");
-		exit(-1);
-	}
-
-	int fd = open("/dev/null", O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(-1);
-	}
-
-	close(0);
-	close(1);
-	close(2);
-
-	dup2(fd, 0);
-	dup2(fd, 1);
-	dup2(fd, 2);
-
-	if (auto env = cmd.env.get(); env && env->env)
-		execle("/bin/sh", "/bin/sh", "-c", cmd.cmd.c_str(), nullptr, env->env.get());
-	else
-		execl("/bin/sh", "/bin/sh", "-c", cmd.cmd.c_str(), nullptr);
-}
-
 static void clear_oneshot(struct keyboard *kbd, [[maybe_unused]] const char* reason)
 {
 	size_t i = 0;
@@ -539,6 +698,7 @@ static void clear_oneshot(struct keyboard *kbd, [[maybe_unused]] const char* rea
 
 	kbd->oneshot_latch = 0;
 	kbd->oneshot_timeout = 0;
+	kbd->timers.cancel(TIMER_ONESHOT);
 }
 
 static void clear(struct keyboard *kbd)
@@ -556,6 +716,7 @@ static void clear(struct keyboard *kbd)
 	}
 
 	kbd->active_macro = -1;
+	kbd->timers.cancel(TIMER_MACRO);
 
 	reset_keystate(kbd);
 }
@@ -568,37 +729,100 @@ static void setlayout(struct keyboard *kbd, int idx)
 	if (kbd->layout) {
 		// TODO: this may not actually work as expected
 		kbd->layer_state[kbd->layout].active_s--;
+		update_layer_set(kbd, kbd->layout);
 	}
 	if (idx) {
 		kbd->layer_state[idx].active_s++;
 		kbd->layer_state[idx].activation_time = 1;
+		update_layer_set(kbd, idx);
 	}
 	kbd->layout = idx;
 	kbd->output.on_layer_change(kbd, &kbd->config.layers[idx], 1);
 }
 
 
-static void schedule_timeout(struct keyboard *kbd, int64_t timeout)
+void timer_heap::swap_entries(size_t a, size_t b)
 {
-	assert(kbd->nr_timeouts < ARRAY_SIZE(kbd->timeouts));
-	kbd->timeouts[kbd->nr_timeouts++] = timeout;
+	std::swap(heap[a], heap[b]);
+	pos[static_cast<size_t>(heap[a].id)] = a + 1;
+	pos[static_cast<size_t>(heap[b].id)] = b + 1;
 }
 
-static int64_t calculate_main_loop_timeout(struct keyboard *kbd, int64_t time)
+void timer_heap::sift_up(size_t i)
 {
-	size_t i;
-	int64_t timeout = 0;
-	size_t n = 0;
+	while (i && heap[i].deadline < heap[(i - 1) / 2].deadline) {
+		swap_entries(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
 
-	for (i = 0; i < kbd->nr_timeouts; i++)
-		if (kbd->timeouts[i] > time) {
-			if (!timeout || kbd->timeouts[i] < timeout)
-				timeout = kbd->timeouts[i];
+void timer_heap::sift_down(size_t i)
+{
+	while (true) {
+		size_t min = i;
+		size_t l = i * 2 + 1;
+		size_t r = i * 2 + 2;
+
+		if (l < size && heap[l].deadline < heap[min].deadline)
+			min = l;
+		if (r < size && heap[r].deadline < heap[min].deadline)
+			min = r;
+		if (min == i)
+			return;
+
+		swap_entries(i, min);
+		i = min;
+	}
+}
 
-			kbd->timeouts[n++] = kbd->timeouts[i];
-		}
+void timer_heap::remove_at(size_t i)
+{
+	pos[static_cast<size_t>(heap[i].id)] = 0;
+	if (i != --size) {
+		heap[i] = heap[size];
+		pos[static_cast<size_t>(heap[i].id)] = i + 1;
+		sift_down(i);
+		sift_up(i);
+	}
+}
+
+void timer_heap::schedule(enum kbd_timer_e id, int64_t deadline)
+{
+	if (size_t i = pos[static_cast<size_t>(id)]) {
+		// Reschedule (the old deadline is stale)
+		heap[i - 1].deadline = deadline;
+		sift_down(i - 1);
+		sift_up(i - 1);
+		return;
+	}
+
+	heap[size] = {deadline, id};
+	pos[static_cast<size_t>(id)] = size + 1;
+	sift_up(size++);
+}
+
+void timer_heap::cancel(enum kbd_timer_e id)
+{
+	if (size_t i = pos[static_cast<size_t>(id)])
+		remove_at(i - 1);
+}
+
+void timer_heap::expire(int64_t time)
+{
+	while (size && heap[0].deadline <= time)
+		remove_at(0);
+}
+
+static void schedule_timeout(struct keyboard *kbd, enum kbd_timer_e id, int64_t timeout)
+{
+	kbd->timers.schedule(id, timeout);
+}
+
+static int64_t calculate_main_loop_timeout(struct keyboard *kbd, int64_t time)
+{
+	kbd->timers.expire(time);
 
-	kbd->nr_timeouts = n;
+	int64_t timeout = kbd->timers.next();
 	return timeout ? timeout - time : 0;
 }
 
@@ -620,6 +844,49 @@ static void do_keysequence(struct keyboard *kbd, int16_t dl, int pressed, int64_
 		kbd->last_simple_key_time = time;
 }
 
+static void streak_release(struct keyboard *kbd, int64_t time)
+{
+	// The tap would otherwise have been resolved on release at best
+	kbd->streak.saved += std::min(time, kbd->streak.max_wait) - kbd->streak.start;
+	dbg("%s released (streak), %zu keys resolved early, %zu ms saved", KEY_NAME(kbd->streak.code),
+	    size_t(kbd->streak.resolved), size_t(kbd->streak.saved));
+	kbd->streak.code = 0;
+}
+
+static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const struct descriptor *d, int16_t dl, int pressed, int64_t time);
+
+/*
+ * An overload or timeout() pressed shortly after a simple key is most
+ * likely part of a typing roll, so it performs its tap action right away
+ * (and on release).
+ */
+static bool resolve_streak(struct keyboard *kbd, uint16_t code, const struct descriptor *action, int16_t dl, int64_t time, int64_t max_wait)
+{
+	struct cache_entry *ce;
+
+	if (!kbd->config.overload_streak_timeout ||
+	    time - kbd->last_simple_key_time >= kbd->config.overload_streak_timeout)
+		return false;
+	// Macro taps are executed once and never held
+	if (action->op == OP_MACRO || action->op == OP_MACRO2)
+		return false;
+	if (!(ce = cache_get(kbd, code)))
+		return false;
+
+	if (kbd->streak.code)
+		streak_release(kbd, time);
+
+	dbg("%s resolved early (streak)", KEY_NAME(code));
+	ce->d = *action;
+	kbd->streak.code = code;
+	kbd->streak.start = time;
+	kbd->streak.max_wait = max_wait;
+	kbd->streak.resolved++;
+
+	process_descriptor(kbd, code, action, dl, 1, time);
+	return true;
+}
+
 static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const struct descriptor *d, int16_t dl, int pressed, int64_t time)
 {
 	int64_t timeout = 0;
@@ -646,7 +913,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			do_keysequence(kbd, dl, pressed, time, new_code, macro[0].mods.mods, macro[0].mods.wildc);
 		} else if (pressed) {
 			// Proceed normally
-			execute_macro(kbd, dl, macro_code, code);
+			execute_macro(kbd, dl, macro_code, code, time);
 		}
 		break;
 	}
@@ -711,6 +978,9 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 		if (pressed) {
 			int16_t layer = d->args[0].idx;
 
+			if (resolve_streak(kbd, code, &kbd->config.descriptors[d->args[1].idx], dl, time, time + d->args[2].timeout))
+				break;
+
 			kbd->pending_key.code = code;
 			kbd->pending_key.behaviour =
 				d->op == OP_OVERLOAD_TIMEOUT_TAP ?
@@ -723,7 +993,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			kbd->pending_key.action2.args[0].idx = layer;
 			kbd->pending_key.expire = time + d->args[2].timeout;
 
-			schedule_timeout(kbd, kbd->pending_key.expire);
+			schedule_timeout(kbd, TIMER_PENDING_KEY, kbd->pending_key.expire);
 		}
 
 		break;
@@ -766,6 +1036,39 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 		if(pressed)
 			clear(kbd);
 		break;
+	case OP_MOUSE_MOVE:
+		if (pressed && !kbd->mouse.vx && !kbd->mouse.vy) {
+			kbd->mouse.start = kbd->mouse.last = time;
+			kbd->mouse.x = kbd->mouse.y = 0;
+		}
+		kbd->mouse.vx += pressed ? d->args[0].sensitivity : -d->args[0].sensitivity;
+		kbd->mouse.vy += pressed ? d->args[1].sensitivity : -d->args[1].sensitivity;
+		if (kbd->mouse.vx || kbd->mouse.vy)
+			update_mouse(kbd, time);
+		else
+			kbd->timers.cancel(TIMER_MOUSE);
+		break;
+	case OP_MOUSE_SPEED:
+		if (pressed)
+			kbd->mouse.speed = d->args[0].sensitivity;
+		else if (kbd->mouse.speed == d->args[0].sensitivity)
+			kbd->mouse.speed = 0;
+		break;
+	case OP_MOUSE_DRAG:
+		if (pressed) {
+			kbd->mouse.drag = !kbd->mouse.drag;
+			send_key(kbd, BTN_LEFT, kbd->mouse.drag);
+		}
+		break;
+	case OP_LEADER:
+		if (pressed && !kbd->config.leader.nodes.empty()) {
+			kbd->leader.active = true;
+			kbd->leader.node = 0;
+			kbd->leader.expire = time + kbd->config.leader_timeout;
+			kbd->queues.leader.clear();
+			schedule_timeout(kbd, TIMER_LEADER, kbd->leader.expire);
+		}
+		break;
 	case OP_OVERLOAD:
 	case OP_OVERLOADM:
 		idx = d->args[0].idx;
@@ -776,6 +1079,10 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			idx = auto_layer();
 
 		if (pressed) {
+			int64_t max_wait = kbd->config.overload_tap_timeout ? time + kbd->config.overload_tap_timeout : INT64_MAX;
+			if (d->op == OP_OVERLOAD && resolve_streak(kbd, code, action, dl, time, max_wait))
+				break;
+
 			kbd->overload_start_time = time;
 			activate_layer(kbd, code, idx);
 			update_mods(kbd, -1, 0);
@@ -791,7 +1098,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 					 * Macro release relies on event logic, so we can't just synthesize a
 					 * descriptor release.
 					 */
-					execute_macro(kbd, dl, action->args[0].code, code);
+					execute_macro(kbd, dl, action->args[0].code, code, time);
 				} else {
 					process_descriptor(kbd, code, action, dl, 1, time);
 					process_descriptor(kbd, code, action, dl, 0, time);
@@ -817,7 +1124,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 				kbd->layer_state[idx].oneshot_depth++;
 				if (kbd->config.oneshot_timeout) {
 					kbd->oneshot_timeout = time + kbd->config.oneshot_timeout;
-					schedule_timeout(kbd, kbd->oneshot_timeout);
+					schedule_timeout(kbd, TIMER_ONESHOT, kbd->oneshot_timeout);
 				}
 			} else {
 				deactivate_layer(kbd, idx);
@@ -844,12 +1151,12 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 
 			clear_oneshot(kbd, "macro");
 
-			timeout += execute_macro(kbd, dl, macro_idx, code);
+			execute_macro(kbd, dl, macro_idx, code, time);
 			kbd->active_macro = macro_idx;
 			kbd->active_macro_layer = dl;
 
 			kbd->macro_timeout = time + timeout;
-			schedule_timeout(kbd, kbd->macro_timeout);
+			schedule_timeout(kbd, TIMER_MACRO, kbd->macro_timeout);
 		}
 
 		break;
@@ -879,6 +1186,10 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 		break;
 	case OP_TIMEOUT:
 		if (pressed) {
+			// The first action is also the one an interrupting key picks
+			if (resolve_streak(kbd, code, &kbd->config.descriptors[d->args[0].idx], dl, time, time + d->args[1].timeout))
+				break;
+
 			kbd->pending_key.action1 = kbd->config.descriptors[d->args[0].idx];
 			kbd->pending_key.action2 = kbd->config.descriptors[d->args[2].idx];
 
@@ -887,7 +1198,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			kbd->pending_key.expire = time + d->args[1].timeout;
 			kbd->pending_key.behaviour = PK_INTERRUPT_ACTION1;
 
-			schedule_timeout(kbd, kbd->pending_key.expire);
+			schedule_timeout(kbd, TIMER_PENDING_KEY, kbd->pending_key.expire);
 		}
 
 		break;
@@ -940,7 +1251,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			}
 
 			if (d->op == OP_SWAPM)
-				execute_macro(kbd, dl, d->args[1].code, code);
+				execute_macro(kbd, dl, d->args[1].code, code, time);
 		} else if (d->op == OP_SWAPM) {
 			auto& macro = kbd->config.macros[d->args[1].code & INT16_MAX];
 			if (macro.size == 1 && macro[0].type <= MACRO_KEY_TAP) {
@@ -969,6 +1280,7 @@ std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard> kbd)
 	kbd->update_layer_state();
 	kbd->layer_state[0].active_s = 1;
 	kbd->layer_state[0].activation_time = 0;
+	update_layer_set(kbd.get(), 0);
 
 	if (kbd->config.default_layout && kbd->config.default_layout != kbd->config.layers[0].name) {
 		int found = 0;
@@ -978,6 +1290,7 @@ std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard> kbd)
 			if (layer->name == kbd->config.default_layout) {
 				kbd->layer_state[i].active_s = 1;
 				kbd->layer_state[i].activation_time = 1;
+				update_layer_set(kbd.get(), i);
 				kbd->layout = i;
 				found = 1;
 				break;
@@ -989,8 +1302,9 @@ std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard> kbd)
 				kbd->config.default_layout.c_str());
 	}
 
-	kbd->chord.queue_sz = 0;
+	kbd->queues.chord.reserve(32);
 	kbd->chord.state = CHORD_INACTIVE;
+	kbd->queues.pending_key.reserve(32);
 
 	return kbd;
 }
@@ -1001,6 +1315,7 @@ static int resolve_chord(struct keyboard *kbd)
 	const struct chord *chord = kbd->chord.match;
 
 	kbd->chord.state = CHORD_RESOLVING;
+	kbd->timers.cancel(TIMER_CHORD);
 
 	if (chord) {
 		size_t i;
@@ -1024,10 +1339,7 @@ static int resolve_chord(struct keyboard *kbd)
 		process_event(kbd, code, 1, kbd->chord.last_code_time);
 	}
 
-
-	kbd_process_events(kbd,
-			   kbd->chord.queue + queue_offset,
-			   kbd->chord.queue_sz - queue_offset);
+	refeed_queue(kbd, kbd->queues.chord, queue_offset);
 	kbd->chord.state = CHORD_INACTIVE;
 	return 1;
 }
@@ -1079,7 +1391,7 @@ static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_
 	case CHORD_RESOLVING:
 		return 0;
 	case CHORD_INACTIVE:
-		kbd->chord.queue_sz = 0;
+		kbd->queues.chord.clear();
 		kbd->chord.match = NULL;
 		kbd->chord.start_code = code;
 
@@ -1091,7 +1403,7 @@ static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_
 			case 1:
 				kbd->chord.state = CHORD_PENDING_DISAMBIGUATION;
 				kbd->chord.last_code_time = time;
-				schedule_timeout(kbd, time + interkey_timeout);
+				schedule_timeout(kbd, TIMER_CHORD, time + interkey_timeout);
 				return 1;
 			default:
 			case 2:
@@ -1099,7 +1411,7 @@ static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_
 
 				if (hold_timeout) {
 					kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
-					schedule_timeout(kbd, time + hold_timeout);
+					schedule_timeout(kbd, TIMER_CHORD, time + hold_timeout);
 				} else {
 					return resolve_chord(kbd);
 				}
@@ -1111,7 +1423,7 @@ static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_
 				if (kbd->chord.match) {
 					int64_t timeleft = hold_timeout - interkey_timeout;
 					if (timeleft > 0) {
-						schedule_timeout(kbd, time + timeleft);
+						schedule_timeout(kbd, TIMER_CHORD, time + timeleft);
 						kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
 					} else {
 						return resolve_chord(kbd);
@@ -1139,7 +1451,7 @@ static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_
 				kbd->chord.last_code_time = time;
 
 				kbd->chord.state = CHORD_PENDING_DISAMBIGUATION;
-				schedule_timeout(kbd, time + interkey_timeout);
+				schedule_timeout(kbd, TIMER_CHORD, time + interkey_timeout);
 				return 1;
 			default:
 			case 2:
@@ -1147,7 +1459,7 @@ static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_
 
 				if (hold_timeout) {
 					kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
-					schedule_timeout(kbd, time + hold_timeout);
+					schedule_timeout(kbd, TIMER_CHORD, time + hold_timeout);
 				} else {
 					return resolve_chord(kbd);
 				}
@@ -1183,16 +1495,14 @@ int handle_pending_key(struct keyboard *kbd, uint16_t code, int pressed, int64_t
 	struct descriptor action = {};
 
 	if (code) {
-		struct key_event *ev;
-
-		assert(kbd->pending_key.queue_sz < ARRAY_SIZE(kbd->pending_key.queue));
+		struct key_event ev = {};
 
 		if (!pressed) {
 			size_t i;
 			int found = 0;
 
-			for (i = 0; i < kbd->pending_key.queue_sz; i++)
-				if (kbd->pending_key.queue[i].code == code)
+			for (i = 0; i < kbd->queues.pending_key.size(); i++)
+				if (kbd->queues.pending_key[i].code == code)
 					found = 1;
 
 			/* Propagate key up events for keys which were struck before the pending key. */
@@ -1200,12 +1510,11 @@ int handle_pending_key(struct keyboard *kbd, uint16_t code, int pressed, int64_t
 				return 0;
 		}
 
-		ev = &kbd->pending_key.queue[kbd->pending_key.queue_sz];
-		ev->code = code;
-		ev->pressed = pressed;
-		ev->timestamp = time;
+		ev.code = code;
+		ev.pressed = pressed;
+		ev.timestamp = time;
 
-		kbd->pending_key.queue_sz++;
+		kbd->queues.pending_key.push(ev);
 	}
 
 
@@ -1225,27 +1534,20 @@ int handle_pending_key(struct keyboard *kbd, uint16_t code, int pressed, int64_t
 	} else if (kbd->pending_key.behaviour == PK_UNINTERRUPTIBLE_TAP_ACTION2 && !pressed) {
 		size_t i;
 
-		for (i = 0; i < kbd->pending_key.queue_sz; i++)
-			if (kbd->pending_key.queue[i].code == code) {
+		for (i = 0; i < kbd->queues.pending_key.size(); i++)
+			if (kbd->queues.pending_key[i].code == code) {
 				action = kbd->pending_key.action2;
 				break;
 			}
 	}
 
 	if (action.op != OP_NULL) {
-		/* Create a copy of the queue on the stack to
-		   allow for recursive pending key processing. */
-		struct key_event queue[ARRAY_SIZE(kbd->pending_key.queue)];
-		size_t queue_sz = kbd->pending_key.queue_sz;
-
 		uint16_t code = kbd->pending_key.code;
 		int16_t dl = kbd->pending_key.dl;
 
-		memcpy(queue, kbd->pending_key.queue, sizeof kbd->pending_key.queue);
-
 		kbd->pending_key.code = 0;
-		kbd->pending_key.queue_sz = 0;
 		kbd->pending_key.tap_expiry = 0;
+		kbd->timers.cancel(TIMER_PENDING_KEY);
 
 		struct cache_entry ce = {
 			.code = 0,
@@ -1257,13 +1559,91 @@ int handle_pending_key(struct keyboard *kbd, uint16_t code, int pressed, int64_t
 		cache_set(kbd, code, &ce);
 		process_descriptor(kbd, code, &action, dl, 1, time);
 
-		/* Flush queued events */
-		kbd_process_events(kbd, queue, queue_sz);
+		/*
+		 * Flush queued events. They are replayed in place, recursive
+		 * pending keys queue their events behind them.
+		 */
+		refeed_queue(kbd, kbd->queues.pending_key, 0);
 	}
 
 	return 1;
 }
 
+/*
+ * Advances a leader key sequence by one trie transition. Keys that can't
+ * continue it abandon the sequence, replaying the keys consumed so far.
+ */
+static int handle_leader(struct keyboard *kbd, uint16_t code, int pressed, int64_t time)
+{
+	auto& leader = kbd->leader;
+	auto& queue = kbd->queues.leader;
+	const auto& trie = kbd->config.leader;
+
+	if (!leader.active)
+		return 0;
+
+	uint16_t last_code = 0;
+	if (code) {
+		if (!pressed) {
+			bool found = false;
+
+			for (size_t i = 0; i < queue.size(); i++)
+				if (queue[i].code == code)
+					found = true;
+
+			// Propagate key up events for keys struck before the sequence
+			if (!found)
+				return 0;
+		}
+
+		queue.push({ .code = code, .pressed = uint16_t(pressed & 1), .timestamp = int(time) });
+		if (!pressed)
+			return 1;
+
+		if (uint32_t next = trie.step(leader.node, code)) {
+			leader.node = next;
+			if (trie.nodes[next].count) {
+				leader.expire = time + kbd->config.leader_timeout;
+				schedule_timeout(kbd, TIMER_LEADER, leader.expire);
+				return 1;
+			}
+
+			// Complete: the last key holds the action
+			struct cache_entry ce = {
+				.code = 0,
+				.d = trie.nodes[next].d,
+				.dl = 0,
+				.layer = 0,
+			};
+
+			leader.active = false;
+			queue.clear();
+			kbd->timers.cancel(TIMER_LEADER);
+			cache_set(kbd, code, &ce);
+			process_descriptor(kbd, code, &ce.d, 0, 1, time);
+			return 1;
+		}
+	} else if (time < leader.expire) {
+		return 0;
+	} else if (struct descriptor d = trie.nodes[leader.node].d) {
+		// A complete sequence which could have been continued
+		for (size_t i = 0; i < queue.size(); i++)
+			if (queue[i].pressed)
+				last_code = queue[i].code;
+
+		leader.active = false;
+		queue.clear();
+		process_descriptor(kbd, last_code, &d, 0, 1, time);
+		process_descriptor(kbd, last_code, &d, 0, 0, time);
+		return 1;
+	}
+
+	leader.active = false;
+	kbd->timers.cancel(TIMER_LEADER);
+	refeed_queue(kbd, queue, 0);
+	return 1;
+}
+
 /*
  * `code` may be 0 in the event of a timeout.
  *
@@ -1271,14 +1651,132 @@ int handle_pending_key(struct keyboard *kbd, uint16_t code, int pressed, int64_t
  * of process_event must take place. A return value of 0 permits the
  * main loop to call at liberty.
  */
+static void update_transparent(struct keyboard *kbd)
+{
+	auto bound = kbd->config.special_keys;
+	for (uint64_t mask = kbd->layer_mask; mask; mask &= mask - 1)
+		bound |= kbd->config.layers[std::countr_zero(mask)].bound;
+	for (size_t i = 64; i < kbd->config.layers.size(); i++) {
+		if (kbd->layer_state[i].active())
+			bound |= kbd->config.layers[i].bound;
+	}
+
+	kbd->transparent = ~bound;
+	kbd->transparent_dirty = false;
+}
+
+static void passthrough_release(struct keyboard *kbd, uint16_t code, int64_t time)
+{
+	kbd->passthrough_keys[code] = 0;
+	send_key(kbd, code, 0);
+	update_mods(kbd, -1, 0);
+	kbd->last_simple_key_time = time;
+}
+
+/*
+ * Send keys which no active layer binds directly to the output, provided
+ * that no chord, pending key, oneshot, macro or modifier could affect them.
+ * The result is identical to looking up the default descriptor.
+ */
+static bool passthrough_idle(struct keyboard *kbd)
+{
+	return kbd->chord.state == CHORD_INACTIVE && !kbd->pending_key.code && !kbd->oneshot_latch && kbd->active_macro < 0 && !kbd->leader.active;
+}
+
+static bool passthrough_mods_clear(struct keyboard *kbd)
+{
+	if (get_mods(kbd) || kbd->applied_mods || kbd->mods_dirty)
+		return false;
+	for (auto& ce : kbd->cache) {
+		// Held key sequences may require mods (see update_mods)
+		if (ce.code && ce.d.op == OP_KEYSEQUENCE && (ce.d.args[1].mods & ~ce.d.args[2].wildc))
+			return false;
+	}
+	return true;
+}
+
+static bool passthrough(struct keyboard *kbd, uint16_t code, int pressed, int64_t time)
+{
+	if (!passthrough_idle(kbd))
+		return false;
+
+	if (!pressed) {
+		if (!kbd->passthrough_keys[code])
+			return false;
+		passthrough_release(kbd, code, time);
+		return true;
+	}
+
+	// Repeated key down, ignored as in process_event()
+	if (kbd->passthrough_keys[code])
+		return true;
+
+	if (!passthrough_mods_clear(kbd))
+		return false;
+	if (kbd->transparent_dirty)
+		update_transparent(kbd);
+	if (!kbd->transparent[code] || cache_get(kbd, code))
+		return false;
+
+	kbd->passthrough_keys[code] = 1;
+	if (kbd->keystate[code])
+		send_key(kbd, code, 0);
+	send_key(kbd, code, 1);
+	kbd->last_simple_key_time = time;
+	kbd->last_pressed_code = code;
+	return true;
+}
+
+/*
+ * Whether wheel motion can skip the engine and be forwarded as a single
+ * value per frame: true if passthrough() would accept every wheel tick.
+ */
+bool kbd_wheel_passthrough(struct keyboard *kbd, int64_t time)
+{
+	if (kbd->generic || !passthrough_idle(kbd) || !passthrough_mods_clear(kbd))
+		return false;
+	if (kbd->transparent_dirty)
+		update_transparent(kbd);
+	for (uint16_t code = KEYD_WHEELUP; code <= KEYD_WHEELRIGHT; code++) {
+		if (!kbd->transparent[code] || cache_get(kbd, code))
+			return false;
+	}
+
+	// Scrolling doesn't type anything
+	kbd->abbrev_state = 0;
+	kbd->last_simple_key_time = time;
+	return true;
+}
+
+/*
+ * Stages for features absent from F are compiled out, see
+ * kbd_process_events() for variant selection.
+ */
+template <uint8_t F>
 static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, int64_t time)
 {
 	int dl = -1;
 
-	if (handle_chord(kbd, code, pressed, time))
+	if (kbd->macro_task.active() && time >= kbd->macro_task_time)
+		run_macros(kbd, time);
+
+	if (kbd->mouse.vx || kbd->mouse.vy)
+		update_mouse(kbd, time);
+
+	if (code && !kbd->generic && passthrough(kbd, code, pressed, time))
 		goto exit;
 
-	if (handle_pending_key(kbd, code, pressed, time))
+	if constexpr (F & FEATURE_CHORDS) {
+		if (handle_chord(kbd, code, pressed, time))
+			goto exit;
+	}
+
+	if constexpr (F & FEATURE_PENDING) {
+		if (handle_pending_key(kbd, code, pressed, time))
+			goto exit;
+	}
+
+	if (handle_leader(kbd, code, pressed, time))
 		goto exit;
 
 	if (kbd->oneshot_timeout && time >= kbd->oneshot_timeout) {
@@ -1286,14 +1784,20 @@ static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, i
 		update_mods(kbd, -1, 0);
 	}
 
-	if (kbd->active_macro >= 0) {
+	if ((F & FEATURE_MACROS) && kbd->active_macro >= 0) {
 		if (code) {
 			kbd->active_macro = -1;
+			kbd->timers.cancel(TIMER_MACRO);
 			update_mods(kbd, -1, 0);
 		} else if (time >= kbd->macro_timeout) {
-			auto add = execute_macro(kbd, kbd->active_macro_layer, kbd->active_macro, code);
-			kbd->macro_timeout = add + time + kbd->macro_repeat_interval;
-			schedule_timeout(kbd, kbd->macro_timeout);
+			// Don't repeat before the previous execution is done
+			if (!kbd->macro_task.active() && kbd->macro_queue.empty())
+				execute_macro(kbd, kbd->active_macro_layer, kbd->active_macro, code, time);
+			if (kbd->macro_task.active())
+				kbd->macro_timeout = kbd->macro_task_time + kbd->macro_repeat_interval;
+			else
+				kbd->macro_timeout = time + kbd->macro_repeat_interval;
+			schedule_timeout(kbd, TIMER_MACRO, kbd->macro_timeout);
 		}
 	}
 
@@ -1308,10 +1812,10 @@ static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, i
 			 * by unorthodox hardware or by different
 			 * devices mapped to the same config.
 			 */
-			if (cache_get(kbd, code))
+			if (cache_get(kbd, code) || kbd->passthrough_keys[code])
 				goto exit;
 
-			lookup_descriptor(kbd, code, &d, &dl);
+			lookup_descriptor<F>(kbd, code, &d, &dl);
 
 			struct cache_entry ce = {
 				.code = 0,
@@ -1323,44 +1827,62 @@ static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, i
 				goto exit;
 		} else {
 			struct cache_entry *ce;
-			if (!(ce = cache_get(kbd, code)))
+			if (!(ce = cache_get(kbd, code))) {
+				if (kbd->passthrough_keys[code])
+					passthrough_release(kbd, code, time);
 				goto exit;
+			}
 
 			cache_set(kbd, code, NULL);
 
 			d = ce->d;
 			dl = ce->dl;
+
+			if (code == kbd->streak.code)
+				streak_release(kbd, time);
 		}
 
 		process_descriptor(kbd, code, &d, dl, pressed, time);
 	}
 
-
 exit:
+	if (kbd->abbrev_match) {
+		// Erases the abbreviation and types its expansion
+		execute_macro(kbd, -1, kbd->abbrev_match - 1, 0, time);
+		kbd->abbrev_match = 0;
+	}
+
 	return calculate_main_loop_timeout(kbd, time);
 }
 
 
-int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n, bool real)
+/*
+ * Events are fetched by index since the underlying storage
+ * may move while they are being processed (see refeed_queue).
+ */
+template <uint8_t F>
+static int64_t feed_events(struct keyboard *kbd, size_t n, auto&& get_event, bool real)
 {
-	assert(kbd->config.finalized);
-
 	size_t i = 0;
 	int64_t timeout = 0;
 	int64_t timeout_ts = 0;
 
 	while (i != n) {
-		const struct key_event *ev = &events[i];
+		const struct key_event ev = get_event(i);
 		if (real) {
-			kbd->capstate[ev->code] = ev->pressed;
+			kbd->capstate[ev.code] = ev.pressed;
+			if (kbd->config.what_mods(ev.code))
+				kbd->mods_dirty = true;
 		}
 
-		if (timeout > 0 && timeout_ts <= ev->timestamp) {
-			timeout = process_event(kbd, 0, 0, timeout_ts);
+		kbd->output_mark = kbd->output_sz;
+
+		if (timeout > 0 && timeout_ts <= ev.timestamp) {
+			timeout = process_event<F>(kbd, 0, 0, timeout_ts);
 			timeout_ts = timeout_ts + timeout;
 		} else {
-			timeout = process_event(kbd, ev->code, ev->pressed, ev->timestamp);
-			timeout_ts = ev->timestamp + timeout;
+			timeout = process_event<F>(kbd, ev.code, ev.pressed, ev.timestamp);
+			timeout_ts = ev.timestamp + timeout;
 			i++;
 		}
 	}
@@ -1368,32 +1890,117 @@ int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events,
 	return timeout;
 }
 
+static void refeed_queue(struct keyboard *kbd, struct key_event_queue& queue, size_t offset)
+{
+	const uint32_t begin = queue.head + offset;
+	const uint32_t end = queue.tail;
+
+	// Detach events, they stay pinned until the outermost re-feed is done
+	queue.head = end;
+	queue.refeed++;
+
+	feed_events<FEATURE_ENGINE>(kbd, end - begin, [&](size_t i) -> const key_event& {
+		return queue.get(begin + i);
+	}, false);
+
+	if (!--queue.refeed)
+		queue.pin = queue.head;
+}
+
+template <uint8_t F>
+static int64_t process_events(struct keyboard *kbd, const struct key_event *events, size_t n, bool real)
+{
+	return feed_events<F>(kbd, n, [&](size_t i) -> const key_event& {
+		return events[i];
+	}, real);
+}
+
+static constexpr auto engines = []<uint8_t... F>(std::integer_sequence<uint8_t, F...>) {
+	return std::array{&process_events<F>...};
+}(std::make_integer_sequence<uint8_t, FEATURE_ENGINE + 1>());
+
+/* Features that the engine must handle, including state left in flight. */
+static uint8_t engine_features(struct keyboard *kbd)
+{
+	uint8_t features = kbd->config.features & FEATURE_ENGINE;
+
+	if (kbd->chord.state != CHORD_INACTIVE)
+		features |= FEATURE_CHORDS;
+	for (auto& ac : kbd->active_chords) {
+		if (ac.active)
+			features |= FEATURE_CHORDS;
+	}
+	if (kbd->pending_key.code)
+		features |= FEATURE_PENDING;
+	if (kbd->active_macro >= 0)
+		features |= FEATURE_MACROS;
+
+	return features;
+}
+
+int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n, bool real)
+{
+	assert(kbd->config.finalized);
+	ALLOC_WATCH("kbd_process_events");
+
+	uint8_t features = kbd->generic ? FEATURE_ENGINE : engine_features(kbd);
+	int64_t timeout = engines[features](kbd, events, n, real);
+
+	flush_output(kbd);
+	return timeout;
+}
+
+int64_t kbd_run_timeouts(std::span<const std::unique_ptr<keyboard>> kbds, int64_t time)
+{
+	int64_t next = 0;
+	for (auto& kbd : kbds) {
+		if (int64_t deadline = kbd->timers.next(); deadline && deadline <= time) {
+			struct key_event kev = {};
+			kev.timestamp = time;
+			kbd_process_events(kbd.get(), &kev, 1);
+		}
+		if (int64_t deadline = kbd->timers.next(); deadline && (!next || deadline < next))
+			next = deadline;
+	}
+	return next;
+}
+
 bool kbd_eval(struct keyboard* kbd, std::string_view exp)
 {
 	if (exp.empty())
 		return true;
 	if (exp == "reset") {
+		// The backup also holds the derived state of its bindings
 		kbd->backup->restore(kbd);
+		kbd->transparent_dirty = true;
 		return true;
-	}
-
-	if (exp == "unbind_all") {
+	} else if (exp == "unbind_all") {
 		// TODO: execute clear? Or it's OK?
 		for (auto& layer : kbd->config.layers) {
 			layer.chords.clear();
 			layer.keymap.mapv.clear();
 		}
-		return true;
 	} else {
 		auto section = exp.substr(0, exp.find_first_of(".="));
 		if (section.size() == exp.size() || exp[section.size()] != '.')
 			section = {};
 		else
 			exp.remove_prefix(section.size() + 1);
-		if (int idx = config_add_entry(&kbd->config, section, exp); idx >= 0) {
-			return true;
-		}
+		// The binding itself keeps the key state current
+		if (config_add_entry(&kbd->config, section, exp) < 0)
+			return false;
+		if (kbd->config.finalized)
+			kbd->config.compile_macros();
+		kbd->transparent_dirty = true;
+		return true;
 	}
 
-	return false;
+	// Bindings changed after finalize()
+	if (kbd->config.finalized) {
+		kbd->config.update_bound_keys();
+		kbd->config.update_features();
+		kbd->config.compile_macros();
+	}
+	kbd->transparent_dirty = true;
+	return true;
 }
@@ -13,6 +13,7 @@
 #include "device.h"
 #include <memory>
 #include <bitset>
+#include <span>
 
 #define MAX_ACTIVE_KEYS	32
 #define CACHE_SIZE	16 //Effectively nkro
@@ -26,15 +27,94 @@ struct cache_entry {
 	int16_t layer;
 };
 
-struct key_event {
-	uint16_t code : 10;
-	uint16_t pressed : 1;
-	int timestamp;
+/*
+ * Growable ring buffer of key events. Events handed out for re-feeding
+ * stay valid (pinned) until the outermost re-feed completes, so queued
+ * events can be replayed in place while new events are being queued.
+ */
+struct key_event_queue {
+	std::unique_ptr<key_event[]> buf;
+	uint32_t cap = 0; // Power of 2
+	uint32_t head = 0; // First queued event
+	uint32_t tail = 0; // Past the last queued event
+	uint32_t pin = 0; // Oldest event still referenced (pin <= head)
+	uint32_t refeed = 0; // Re-feed nesting depth
+
+	size_t size() const
+	{
+		return tail - head;
+	}
+
+	bool empty() const
+	{
+		return tail == head;
+	}
+
+	// Access by absolute position
+	const key_event& get(uint32_t pos) const
+	{
+		return buf[pos & (cap - 1)];
+	}
+
+	const key_event& operator[](size_t i) const
+	{
+		return get(head + i);
+	}
+
+	void push(const key_event& ev)
+	{
+		if (tail - pin == cap)
+			grow();
+		buf[tail++ & (cap - 1)] = ev;
+	}
+
+	// Drop all queued events
+	void clear()
+	{
+		head = tail;
+		if (!refeed)
+			pin = head;
+	}
+
+	void reserve(uint32_t n);
+
+private:
+	void grow();
+};
+
+/* Fixed-capacity FIFO of macros waiting for the macro task. */
+struct macro_fifo {
+	std::array<uint16_t, 32> buf; // Power of 2
+	uint32_t head = 0;
+	uint32_t tail = 0;
+
+	bool empty() const
+	{
+		return tail == head;
+	}
+
+	// Returns false if full
+	bool push(uint16_t idx)
+	{
+		if (tail - head == buf.size())
+			return false;
+		buf[tail++ & (buf.size() - 1)] = idx;
+		return true;
+	}
+
+	uint16_t pop()
+	{
+		return buf[head++ & (buf.size() - 1)];
+	}
 };
 
 struct output {
 	void (*send_key) (uint16_t code, uint8_t state);
 	void (*on_layer_change) (const struct keyboard *kbd, struct layer *layer, uint8_t active);
+	/* Optional: emit a batch of key events at once (falls back to send_key). */
+	void (*send_keys) (const struct key_event *events, size_t n);
+	/* Optional: relative pointer motion, one call per frame. */
+	void (*mouse_move) (int x, int y);
 };
 
 enum class chord_state_e : signed char {
@@ -61,20 +141,83 @@ struct active_chord {
 	int layer;
 };
 
-/* May correspond to more than one physical input device. */
-struct keyboard {
-	struct config config;
-	struct output output;
-	std::unique_ptr<config_backup> backup;
+/*
+ * Every deadline has a single owner. Rescheduling replaces the previous
+ * deadline of the same owner, so stale wakeups never accumulate.
+ */
+enum class kbd_timer_e : uint8_t {
+	TIMER_CHORD,
+	TIMER_PENDING_KEY,
+	TIMER_ONESHOT,
+	TIMER_MACRO,
+	TIMER_MACRO_TASK,
+	TIMER_LEADER,
+	TIMER_MOUSE,
+
+	TIMER_MAX,
+};
+
+using enum kbd_timer_e;
+
+/* Indexed binary min-heap of per-owner deadlines. */
+struct timer_heap {
+	static constexpr size_t max = static_cast<size_t>(TIMER_MAX);
+
+	struct entry {
+		int64_t deadline;
+		enum kbd_timer_e id;
+	};
+
+	std::array<entry, max> heap{};
+	std::array<uint8_t, max> pos{}; // Heap position + 1 (0 if not scheduled)
+	uint8_t size = 0;
+
+	void schedule(enum kbd_timer_e id, int64_t deadline);
+	void cancel(enum kbd_timer_e id);
+
+	bool pending(enum kbd_timer_e id) const
+	{
+		return pos[static_cast<size_t>(id)] != 0;
+	}
 
+	// Earliest deadline or 0 if none
+	int64_t next() const
+	{
+		return size ? heap[0].deadline : 0;
+	}
+
+	// Drop all deadlines which are not later than time
+	void expire(int64_t time);
+
+private:
+	void swap_entries(size_t a, size_t b);
+	void sift_up(size_t i);
+	void sift_down(size_t i);
+	void remove_at(size_t i);
+};
+
+/* May correspond to more than one physical input device. */
+struct alignas(64) keyboard {
 	/*
-	 * Cache descriptors to preserve code->descriptor
-	 * mappings in the event of mid-stroke layer changes.
+	 * Hot state: the scalars a key press reads on the common path, kept
+	 * within the first two cache lines. Queues, bitsets, the descriptor
+	 * cache and the configuration follow.
 	 */
-	struct cache_entry cache[CACHE_SIZE];
+
+	/* Modifier state maintained incrementally alongside layer_state and keystate. */
+	uint8_t layer_mods = 0; // Active modifier layers
+	uint8_t fake_mods = 0; // KEYD_FAKEMOD bits of keystate
+	uint8_t applied_mods = 0; // Last set_mods() argument
+	bool mods_dirty = true; // Modifier key state changed since set_mods()
+
+	bool transparent_dirty = true; // Active layer set or bindings changed
+	bool generic = false; // Disable pass-through and specialised engine variants
 
 	int16_t layout = 0;
 
+	/* Bit i is set while layer i is active (see layer_state, layers past 63 aren't tracked). */
+	uint64_t layer_mask = 0;
+
 	uint16_t last_pressed_output_code;
 	uint16_t last_pressed_code;
 
@@ -83,51 +226,112 @@ struct keyboard {
 	uint16_t inhibit_modifier_guard;
 
 	int active_macro = -1;
-	int active_macro_layer;
-	int overload_last_layer_code;
-
-	int64_t macro_timeout;
-	int64_t oneshot_timeout;
-
-	int64_t macro_repeat_interval;
 
-	int64_t overload_start_time;
+	/* Position in config.abbrevs and the expansion it reached, if any. */
+	uint32_t abbrev_state;
+	uint16_t abbrev_match;
 
 	int64_t last_simple_key_time;
 
-	int64_t timeouts[64];
-	size_t nr_timeouts;
-
-	struct active_chord active_chords[KEYD_CHORD_MAX-KEYD_CHORD_1+1];
+	size_t output_sz = 0;
+	size_t output_mark = 0; // Start of the output of the current input event
 
 	struct {
-		struct key_event queue[32];
-		size_t queue_sz;
-
-		const struct chord *match;
-		int match_layer;
+		enum chord_state_e state;
 
 		uint16_t start_code;
 		int64_t last_code_time;
 
-		enum chord_state_e state;
+		const struct chord *match;
+		int match_layer;
 	} chord;
 
 	struct {
 		uint16_t code;
 		int16_t dl;
-		int64_t expire;
-		int64_t tap_expiry;
 
 		enum pending_behaviour_e behaviour;
 
-		struct key_event queue[32];
-		size_t queue_sz;
+		int64_t expire;
+		int64_t tap_expiry;
 
 		struct descriptor action1;
 		struct descriptor action2;
 	} pending_key{};
 
+	/* Leader key sequence being typed (see config::leader). */
+	struct {
+		bool active;
+		uint32_t node;
+		int64_t expire;
+	} leader{};
+
+	/*
+	 * Cache descriptors to preserve code->descriptor
+	 * mappings in the event of mid-stroke layer changes.
+	 */
+	struct cache_entry cache[CACHE_SIZE];
+
+	std::bitset<KEYD_ENTRY_COUNT> capstate; // Input state
+	std::bitset<KEYD_ENTRY_COUNT> keystate; // Vkbd state
+
+	/*
+	 * Keys unbound in every active layer, which may go straight to the
+	 * output while nothing else is in flight (see passthrough()).
+	 */
+	std::bitset<KEYD_ENTRY_COUNT> transparent;
+	std::bitset<KEYD_ENTRY_COUNT> passthrough_keys; // Held via the fast path
+
+	/* Events held back by chord, pending_key and leader. */
+	struct {
+		struct key_event_queue chord;
+		struct key_event_queue pending_key;
+		struct key_event_queue leader; // Consumed keys, replayed on a mismatch
+	} queues;
+
+	/* Mouse keys motion, integrated every millisecond (see update_mouse). */
+	struct {
+		int32_t vx; // Sum of held mousemove() velocities (px/s)
+		int32_t vy;
+		int16_t speed; // Percentage set by mousespeed(), 0 if none
+		bool drag;
+		int64_t start; // Motion start, for acceleration
+		int64_t last; // Last integration step
+		double x; // Sub-pixel remainders
+		double y;
+	} mouse{};
+
+	/* Macro being played out and the ones waiting for it (see run_macros). */
+	struct macro_task macro_task;
+	uint16_t macro_task_idx;
+	int64_t macro_task_time; // When to resume
+	struct macro_fifo macro_queue;
+
+	/* Cold state. */
+
+	int active_macro_layer;
+	int overload_last_layer_code;
+
+	int64_t macro_timeout;
+	int64_t oneshot_timeout;
+
+	int64_t macro_repeat_interval;
+
+	int64_t overload_start_time;
+
+	/* Overloads resolved early by overload_streak_timeout. */
+	struct {
+		uint16_t code; // Most recent one, until released
+		int64_t start;
+		int64_t max_wait; // Latest possible resolution time of the overload
+		uint64_t resolved; // Number of keys resolved early
+		uint64_t saved; // Estimated delay saved (ms)
+	} streak;
+
+	struct timer_heap timers;
+
+	struct active_chord active_chords[KEYD_CHORD_MAX-KEYD_CHORD_1+1];
+
 	struct layer_state_t {
 		uint64_t composite : 1; // Set to 1 if layer is composite and not "empty"
 		uint64_t active_s : 8; // Activation count (signed)
@@ -148,15 +352,22 @@ struct keyboard {
 	{
 		layer_state.resize(config.layers.size());
 		active_layers.resize(config.layers.size());
+		layer_mask = 0;
 		for (size_t i = 0; i < layer_state.size(); i++) {
 			auto& layer = config.layers[i];
 			// Cache whether the layer is truly composite (not dummy)
 			layer_state[i].composite = layer.composition && (!layer.keymap.empty() || !layer.chords.empty());
+			if (i < 64 && layer_state[i].active())
+				layer_mask |= uint64_t(1) << i;
 		}
+		transparent_dirty = true;
 	}
 
-	std::bitset<KEYD_ENTRY_COUNT> capstate; // Input state
-	std::bitset<KEYD_ENTRY_COUNT> keystate; // Vkbd state
+	/*
+	 * Output produced by a single kbd_process_events() call,
+	 * emitted as one batch once processing is finished.
+	 */
+	std::array<key_event, 64> output_buf;
 
 	struct {
 		int x;
@@ -165,11 +376,23 @@ struct keyboard {
 		int sensitivity; /* Mouse units per scroll unit (higher == slower scrolling). */
 		int active;
 	} scroll;
+
+	struct output output;
+	std::unique_ptr<config_backup> backup;
+
+	struct config config;
 };
 
 std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard>);
 
 int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n, bool real = false);
+bool kbd_wheel_passthrough(struct keyboard *kbd, int64_t time);
+
+/*
+ * Process the timeouts due by time on each keyboard, whichever device
+ * sent the last event. Returns the earliest deadline left, or 0.
+ */
+int64_t kbd_run_timeouts(std::span<const std::unique_ptr<keyboard>> kbds, int64_t time);
 bool kbd_eval(struct keyboard *kbd, std::string_view);
 void kbd_reset(struct keyboard *kbd);
 
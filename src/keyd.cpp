@@ -5,6 +5,7 @@
  */
 
 #include "keyd.h"
+#include "concat.hpp"
 #include <link.h>
 #include <dlfcn.h>
 #include <elf.h>
@@ -312,7 +313,7 @@ size_t aux_alloc::get_count() const noexcept
 	return aux_alloc_count;
 }
 
-void* operator new(size_t size, std::align_val_t _align)
+void* aux_allocate(size_t size, std::align_val_t _align)
 {
 	const size_t align = size_t(_align);
 	// The purpose of aux allocator is to provide memory chunks which are unlikely to be deallocated
@@ -355,9 +356,20 @@ void* operator new(size_t size, std::align_val_t _align)
 	}
 }
 
+void* operator new(size_t size, std::align_val_t align)
+{
+#ifdef KEYD_ALLOC_WATCH
+	alloc_watch::record(__builtin_return_address(0));
+#endif
+	return aux_allocate(size, align);
+}
+
 void* operator new(size_t size)
 {
-	return ::operator new(size, std::align_val_t{__STDCPP_DEFAULT_NEW_ALIGNMENT__});
+#ifdef KEYD_ALLOC_WATCH
+	alloc_watch::record(__builtin_return_address(0));
+#endif
+	return aux_allocate(size, std::align_val_t{__STDCPP_DEFAULT_NEW_ALIGNMENT__});
 }
 
 void operator delete(void* ptr, std::align_val_t) noexcept
@@ -392,6 +404,11 @@ void operator delete(void* ptr, size_t) noexcept
 	return ::operator delete(ptr, std::align_val_t{__STDCPP_DEFAULT_NEW_ALIGNMENT__});
 }
 
+void operator delete(void* ptr, size_t, std::align_val_t align) noexcept
+{
+	return ::operator delete(ptr, align);
+}
+
 void operator delete(void* ptr) noexcept
 {
 	return ::operator delete(ptr, std::align_val_t{__STDCPP_DEFAULT_NEW_ALIGNMENT__});
@@ -455,6 +472,7 @@ static int help(int, char *[])
 	       "    monitor [-t]                   Print key events in real time.\n"
 	       "    list-keys                      Print a list of valid key names.\n"
 	       "    reload                         Trigger a reload .\n"
+	       "    compile [<file>...]            Write binary images of config files for faster loading.\n"
 	       "    listen                         Print layer state changes of the running keyd++ daemon to stdout.\n"
 	       "    bind <binding> [<binding>...]  Add the supplied bindings to all loaded configs.\n"
 	       "Options:\n"
@@ -625,6 +643,60 @@ static int reload(int, char *[])
 	return 0;
 }
 
+static bool compile_config(const char *path)
+{
+	config config;
+	ini_cache sources;
+
+	if (!config_parse(&config, path, &sources)) {
+		fprintf(stderr, "failed to parse %s\n", path);
+		return false;
+	}
+
+	config.finalize();
+
+	auto img = concat(path, ".img");
+	if (!config_write_image(&config, sources, img.c_str()))
+		return false;
+
+	// Sources edited while compiling would be shadowed by this image
+	struct config check;
+	if (!config_load_image(&check, img.c_str())) {
+		fprintf(stderr, "%s changed while compiling, removed %s\n", path, img.c_str());
+		unlink(img.c_str());
+		return false;
+	}
+
+	printf("%s -> %s\n", path, img.c_str());
+	return true;
+}
+
+static int compile(int argc, char *argv[])
+{
+	int ret = 0;
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++)
+			ret |= !compile_config(argv[i]);
+		return ret;
+	}
+
+	DIR *dh = opendir(CONFIG_DIR);
+	if (!dh) {
+		perror("opendir");
+		return -1;
+	}
+
+	while (struct dirent *dirent = readdir(dh)) {
+		auto name = concat(CONFIG_DIR "/", dirent->d_name);
+		if (dirent->d_type != DT_DIR && name.get().ends_with(".conf") && !name.get().ends_with(".old.conf"))
+			ret |= !compile_config(name.c_str());
+	}
+
+	closedir(dh);
+	return ret;
+}
+
 struct {
 	const char *name;
 	const char *flag;
@@ -645,6 +717,7 @@ struct {
 
 	{"reload", "", "", reload},
 	{"list-keys", "", "", list_keys},
+	{"compile", "", "", compile},
 };
 
 int main(int argc, char *argv[], char*[])
@@ -97,6 +97,23 @@ int monitor(int argc, char *argv[]);
 int run_daemon(int argc, char *argv[]);
 
 void evloop_add_fd(int fd);
+
+struct spawn_stats {
+	uint64_t spawned;
+	uint64_t failed; // Spawn errors and unsuccessful exits
+	uint64_t running;
+	uint64_t latency_ns; // Total time spent starting commands
+	uint64_t max_latency_ns;
+};
+
+extern struct spawn_stats spawn_stats;
+
+/* Installs the SIGCHLD handler, returns the fd to poll for exited children. */
+int spawn_init();
+void spawn_reap();
+/* Logs spawn_stats, e.g. on reload. */
+void spawn_report();
+void execute_command(ucmd& cmd);
 int evloop(int (*event_handler)(struct event* ev), bool monitor = false);
 
 void xwrite(int fd, const void *buf, size_t sz);
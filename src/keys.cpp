@@ -302,6 +302,74 @@ extern constexpr std::array<keycode_table_ent, KEYD_ENTRY_COUNT> keycode_table =
 	return r;
 }();
 
+/*
+ * Every name in keycode_table, hashed at compile time into an open
+ * addressing table kept at most half full, so probe sequences stay
+ * short. Names are unique, but should two ever clash, the first in table
+ * order wins (an entry's shifted name before its others), as with a scan.
+ */
+struct key_name_slot {
+	uint16_t code = 0;
+	uint8_t kind = 0xff; // 0xff if empty
+};
+
+static constexpr size_t key_name_slots = 4096;
+
+static constexpr uint32_t key_name_hash(std::string_view s)
+{
+	uint32_t h = 2166136261u;
+	for (char c : s)
+		h = (h ^ uint8_t(c)) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+static constexpr std::string_view key_name_of(const keycode_table_ent& ent, uint8_t kind)
+{
+	switch (kind) {
+	case KEYNAME_SHIFTED: return ent.shifted_name ? ent.shifted_name : "";
+	case KEYNAME_ALT: return ent.alt_name ? ent.alt_name : "";
+	case KEYNAME_NUM: return std::string_view(ent.key_num, 7);
+	default: return ent.name();
+	}
+}
+
+static constexpr auto key_name_index = []() {
+	std::array<key_name_slot, key_name_slots> r{};
+
+	for (size_t i = 0; i < KEYD_ENTRY_COUNT; i++) {
+		for (uint8_t kind : {KEYNAME_SHIFTED, KEYNAME_MAIN, KEYNAME_NUM, KEYNAME_ALT}) {
+			const auto name = key_name_of(keycode_table[i], kind);
+			if (name.empty())
+				continue;
+			size_t slot = key_name_hash(name) % key_name_slots;
+			while (r[slot].kind != 0xff && key_name_of(keycode_table[r[slot].code], r[slot].kind) != name)
+				slot = (slot + 1) % key_name_slots;
+			if (r[slot].kind == 0xff)
+				r[slot] = {uint16_t(i), kind};
+		}
+	}
+	return r;
+}();
+
+static_assert(std::ranges::count_if(key_name_index, [](auto& slot) { return slot.kind != 0xff; }) * 2 <= key_name_slots);
+
+int lookup_key_name(std::string_view name, uint8_t *kind)
+{
+	if (name.empty())
+		return -1;
+
+	for (size_t slot = key_name_hash(name) % key_name_slots;; slot = (slot + 1) % key_name_slots) {
+		const auto& ent = key_name_index[slot];
+		if (ent.kind == 0xff)
+			return -1;
+		if (key_name_of(keycode_table[ent.code], ent.kind) == name) {
+			if (kind)
+				*kind = ent.kind;
+			return ent.code;
+		}
+	}
+}
+
 std::array<char, 16> modstring(uint8_t mods)
 {
 	std::array<char, 16> s{};
@@ -352,32 +420,18 @@ int parse_key_sequence(std::string_view s, uint16_t* codep, uint8_t *modsp, uint
 	if (s.starts_with('-') || s.starts_with('=') || s.starts_with('+'))
 		c = s.substr(0, 1);
 
-	for (size_t i = 0; i < KEYD_ENTRY_COUNT; i++) {
-		const struct keycode_table_ent *ent = &keycode_table[i];
-
-		if (true) {
-			if (ent->shifted_name && ent->shifted_name == c) {
-
-				mods |= (1 << MOD_SHIFT);
+	uint8_t kind;
+	if (int code = lookup_key_name(c, &kind); code >= 0) {
+		if (kind == KEYNAME_SHIFTED)
+			mods |= (1 << MOD_SHIFT);
 
-				if (modsp)
-					*modsp = mods;
+		if (modsp)
+			*modsp = mods;
 
-				if (codep)
-					*codep = i;
+		if (codep)
+			*codep = code;
 
-				return s.size() - c.size();
-			} else if (ent->name() == c || std::string_view(ent->key_num, 7) == c || (ent->alt_name && ent->alt_name == c)) {
-
-				if (modsp)
-					*modsp = mods;
-
-				if (codep)
-					*codep = i;
-
-				return s.size() - c.size();
-			}
-		}
+		return s.size() - c.size();
 	}
 
 	// Return number of remaining bytes for partial success
@@ -81,6 +81,17 @@ struct modifier {
 
 int parse_key_sequence(std::string_view, uint16_t* code, uint8_t *mods, uint8_t* wildcards = nullptr);
 
+/* Which name of a keycode_table entry matched. */
+enum key_name_kind : uint8_t {
+	KEYNAME_MAIN, // name()
+	KEYNAME_SHIFTED,
+	KEYNAME_ALT,
+	KEYNAME_NUM, // key_num of a named key
+};
+
+/* Key code with the given name, or -1 if there is none. */
+int lookup_key_name(std::string_view name, uint8_t *kind = nullptr);
+
 #define KEYD_ENTRY_COUNT			1000
 
 extern const std::array<keycode_table_ent, KEYD_ENTRY_COUNT> keycode_table;
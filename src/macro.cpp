@@ -97,30 +97,15 @@ int macro_parse(std::string_view s, macro& macro, struct config* config, const s
 					int xcode;
 
 					if (chrsz == 1 && codepoint < 128) {
-						size_t i = 0;
-						for (i = 1; i < KEYD_ENTRY_COUNT; i++) {
-							const auto name = keycode_table[i].name();
-							const char* altname = keycode_table[i].alt_name;
-							const char *shiftname = keycode_table[i].shifted_name;
-
-							if (name.size() == 1 && name[0] == tok[0]) {
-								ADD_ENTRY(MACRO_KEY_TAP, i).mods = {};
-								break;
-							}
-
-							if (shiftname && shiftname[0] == tok[0] && shiftname[1] == 0) {
-								ADD_ENTRY(MACRO_KEY_TAP, i).mods = { .mods = (1 << MOD_SHIFT), .wildc = 0 };
-								break;
-							}
-
-							if (altname && altname[0] == tok[0] && altname[1] == 0) {
-								ADD_ENTRY(MACRO_KEY_TAP, i).mods = {};
-								break;
-							}
-						}
-						if (i == KEYD_ENTRY_COUNT) {
+						uint8_t kind;
+						int code = lookup_key_name(tok.substr(0, 1), &kind);
+						if (code <= 0)
 							break;
-						}
+
+						if (kind == KEYNAME_SHIFTED)
+							ADD_ENTRY(MACRO_KEY_TAP, code).mods = { .mods = (1 << MOD_SHIFT), .wildc = 0 };
+						else
+							ADD_ENTRY(MACRO_KEY_TAP, code).mods = {};
 					} else if ((xcode = unicode_lookup_index(codepoint)) > 0) {
 						ADD_ENTRY(MACRO_UNICODE, xcode).id = 0;
 					}
@@ -178,22 +163,13 @@ int macro_parse(std::string_view s, macro& macro, struct config* config, const s
 				int xcode;
 
 				if (chrsz == 1 && codepoint < 128) {
-					size_t i = 0;
-					for (i = 1; i < KEYD_ENTRY_COUNT; i++) {
-						const auto name = keycode_table[i].name();
-						const char *shiftname = keycode_table[i].shifted_name;
-
-						if (name.size() == 1 && name[0] == tok[0]) {
-							ADD_ENTRY(MACRO_KEY_TAP, i).mods = {};
-							break;
-						}
-
-						if (shiftname && shiftname[0] == tok[0] && shiftname[1] == 0) {
-							ADD_ENTRY(MACRO_KEY_TAP, i).mods = { .mods = (1 << MOD_SHIFT), .wildc = 0 };
-							break;
-						}
-					}
-					if (i < KEYD_ENTRY_COUNT) {
+					// Alternative names like "\t" aren't typed characters here
+					uint8_t kind;
+					if (int code = lookup_key_name(tok, &kind); code > 0 && kind != KEYNAME_ALT) {
+						if (kind == KEYNAME_SHIFTED)
+							ADD_ENTRY(MACRO_KEY_TAP, code).mods = { .mods = (1 << MOD_SHIFT), .wildc = 0 };
+						else
+							ADD_ENTRY(MACRO_KEY_TAP, code).mods = {};
 						continue;
 					}
 				} else if ((xcode = unicode_lookup_index(codepoint)) > 0) {
@@ -222,104 +198,160 @@ int macro_parse(std::string_view s, macro& macro, struct config* config, const s
 	return 0;
 }
 
-uint64_t macro_execute(void (*output)(uint16_t, uint8_t), const macro& macro, uint64_t timeout, struct config* config)
+macro_script macro::compile(const struct config* config) const
 {
-	uint64_t t = 0;
-	int hold_start = -1;
+	static constexpr std::array<uint16_t, MAX_MOD> def_mods{
+		KEY_LEFTALT,
+		KEY_LEFTMETA,
+		KEY_LEFTSHIFT,
+		KEY_LEFTCTRL,
+		KEY_RIGHTALT,
+	};
+
+	std::array<uint16_t, MAX_MOD> mod_codes = def_mods;
+	if (config) {
+		for (size_t j = 0; j < MAX_MOD; j++)
+			mod_codes[j] = config->modifiers[j] ? config->modifiers[j][0] : 0;
+	}
 
-	for (size_t i = 0; i < macro.size; i++) {
-		const macro_entry *ent = &macro[i];
+	macro_script script;
+	auto emit = [&] (uint16_t code, uint8_t pressed) {
+		script.events.push_back({ .code = code, .pressed = pressed, .timestamp = 0 });
+	};
+	auto mark = [&] (macro_script::mark_e type, uint16_t arg = 0) {
+		script.marks.push_back({ .end = uint32_t(script.events.size()), .type = type, .arg = arg });
+	};
+
+	int hold_start = -1;
+	for (size_t i = 0; i < size; i++) {
+		const macro_entry *ent = &(*this)[i];
 
 		switch (ent->type) {
-			size_t j;
-			uint16_t idx;
 			uint8_t codes[4];
-			uint16_t code;
 			uint8_t mods;
 
 		case MACRO_HOLD:
 			if (hold_start == -1)
 				hold_start = i;
 
-			output(ent->id, 1);
-
+			emit(ent->id, 1);
 			break;
 		case MACRO_RELEASE:
 			if (hold_start != -1) {
-				size_t j;
-
-				for (j = hold_start; j < i; j++) {
-					const struct macro_entry *ent = &macro[j];
-					output(ent->id, 0);
-				}
+				for (size_t j = hold_start; j < i; j++)
+					emit((*this)[j].id, 0);
 
 				hold_start = -1;
 			}
 			break;
 		case MACRO_UNICODE:
-			idx = ent->code | (ent->id << 16);
-
-			unicode_get_sequence(idx, codes);
+			unicode_get_sequence(ent->code, codes);
 
-			for (j = 0; j < 4; j++) {
-				output(codes[j], 1);
-				output(codes[j], 0);
+			for (size_t j = 0; j < 4; j++) {
+				emit(codes[j], 1);
+				emit(codes[j], 0);
 			}
-
 			break;
 		case MACRO_KEY_SEQ:
 		case MACRO_KEY_TAP:
-			code = ent->id;
 			mods = ent->mods.mods;
 
-			static constexpr std::array<uint16_t, MAX_MOD> def_mods{
-				KEY_LEFTALT,
-				KEY_LEFTMETA,
-				KEY_LEFTSHIFT,
-				KEY_LEFTCTRL,
-				KEY_RIGHTALT,
-			};
-
-			for (j = 0; j < MAX_MOD; j++) {
-				uint16_t code = (config ? (config->modifiers[j] ? config->modifiers[j][0] : 0) : def_mods[j]);
-				uint8_t mask = 1 << j;
-
-				if (mods & mask && code)
-					output(code, 1);
+			for (size_t j = 0; j < MAX_MOD; j++) {
+				if (mods & (1 << j) && mod_codes[j])
+					emit(mod_codes[j], 1);
 			}
 
-			if (mods && timeout)
-				t += timeout, usleep(timeout);
+			if (mods)
+				mark(macro_script::MARK_GAP);
 
-			output(code, 1);
-			output(code, 0);
+			emit(ent->id, 1);
+			emit(ent->id, 0);
 
-			for (j = 0; j < MAX_MOD; j++) {
-				uint16_t code = (config ? (config->modifiers[j] ? config->modifiers[j][0] : 0) : def_mods[j]);
-				uint8_t mask = 1 << j;
-
-				if (mods & mask && code)
-					output(code, 0);
+			for (size_t j = 0; j < MAX_MOD; j++) {
+				if (mods & (1 << j) && mod_codes[j])
+					emit(mod_codes[j], 0);
 			}
-
-
 			break;
 		case MACRO_TIMEOUT:
-			t += ent->code * 1000;
-			usleep(ent->code * 1000);
+			mark(macro_script::MARK_DELAY, ent->code);
 			break;
 		case MACRO_COMMAND:
-			extern void execute_command(ucmd& cmd);
-			execute_command(config ? config->commands.at(ent->code) : cmd_buf.at(ent->code));
+			mark(macro_script::MARK_COMMAND, ent->code);
 			break;
 		default:
 			continue;
 		}
 
-		if (timeout)
-			t += timeout, usleep(timeout);
+		mark(macro_script::MARK_GAP);
 	}
 
-	cmd_buf.clear();
-	return t;
+	return script;
+}
+
+void macro_start(macro_task& task, void (*output)(uint16_t, uint8_t), void (*output_batch)(const struct key_event *, size_t),
+		 const macro& macro, uint64_t timeout, struct config* config)
+{
+	task.macro = &macro;
+	task.config = config;
+	task.output = output;
+	task.output_batch = output_batch;
+	task.timeout = timeout;
+	task.pos = 0;
+	task.emitted = 0;
+	task.own = {};
+	if (macro.script.empty())
+		task.own = macro.compile(config);
+	task.commands.clear();
+	// Commands parsed without config only live until the next macro_parse()
+	if (!config)
+		task.commands.swap(cmd_buf);
+}
+
+uint64_t macro_step(macro_task& task)
+{
+	const macro_script& script = task.script();
+	uint64_t delay = 0;
+
+	while (task.pos < script.marks.size()) {
+		const auto& mark = script.marks[task.pos];
+
+		// Pending delays only matter before the next output
+		if (delay && (mark.end > task.emitted || mark.type == macro_script::MARK_COMMAND))
+			return delay;
+
+		if (mark.end > task.emitted) {
+			const key_event *ev = script.events.data() + task.emitted;
+			const size_t n = mark.end - task.emitted;
+
+			if (task.output_batch) {
+				task.output_batch(ev, n);
+			} else {
+				for (size_t i = 0; i < n; i++)
+					task.output(ev[i].code, ev[i].pressed);
+			}
+			task.emitted = mark.end;
+		}
+
+		switch (mark.type) {
+		case macro_script::MARK_GAP:
+			delay += task.timeout;
+			break;
+		case macro_script::MARK_DELAY:
+			delay += mark.arg * 1000;
+			break;
+		case macro_script::MARK_COMMAND:
+			execute_command(task.config ? task.config->commands.at(mark.arg) : task.commands.at(mark.arg));
+			break;
+		}
+
+		task.pos++;
+	}
+
+	if (delay)
+		return delay;
+
+	task.macro = nullptr;
+	task.own = {};
+	task.commands.clear();
+	return 0;
 }
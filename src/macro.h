@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <memory>
+#include <vector>
 #include <string_view>
 #include "utils.hpp"
 
@@ -38,6 +39,38 @@ struct macro_entry {
 
 static_assert(sizeof(macro_entry) == 4);
 
+struct key_event {
+	uint16_t code : 10;
+	uint16_t pressed : 1;
+	int timestamp;
+};
+
+/*
+ * Compiled form of a macro: its output events laid out flat, split by
+ * marks where a delay or a command is due.
+ */
+struct macro_script {
+	enum mark_e : uint8_t {
+		MARK_GAP, // Inter-entry timeout of the task
+		MARK_DELAY,
+		MARK_COMMAND,
+	};
+
+	struct mark {
+		uint32_t end; // Events to emit before the mark
+		mark_e type;
+		uint16_t arg; // Delay (ms) or command index
+	};
+
+	std::vector<key_event> events;
+	std::vector<mark> marks;
+
+	bool empty() const
+	{
+		return marks.empty();
+	}
+};
+
 /*
  * A series of key sequences, timeouts, shell commands
  */
@@ -53,9 +86,49 @@ struct macro {
 	}
 
 	bool equals(const struct config*, const macro&) const;
+
+	// Filled by config::finalize(), resolves modifiers and unicode input
+	macro_script script;
+
+	macro_script compile(const struct config*) const;
 };
 
-uint64_t macro_execute(void (*output)(uint16_t, uint8_t), const macro& macro, uint64_t timeout, struct config* config);
+struct ucmd;
+
+/*
+ * Resumable macro execution. Steps run until a delay is due, so the
+ * caller can schedule the rest on its timer instead of blocking.
+ */
+struct macro_task {
+	const struct macro *macro = nullptr;
+	struct config *config = nullptr;
+	void (*output)(uint16_t, uint8_t) = nullptr;
+	void (*output_batch)(const struct key_event *, size_t) = nullptr; // Optional
+	uint64_t timeout = 0; // Delay after each entry (us)
+	uint32_t pos = 0; // Next mark
+	uint32_t emitted = 0; // Events sent so far
+	macro_script own; // Script of a macro that wasn't compiled beforehand
+	std::vector<ucmd> commands; // Owned commands of a macro parsed without config
+
+	bool active() const
+	{
+		return macro != nullptr;
+	}
+
+	const macro_script& script() const
+	{
+		return macro->script.empty() ? own : macro->script;
+	}
+};
+
+void macro_start(macro_task& task, void (*output)(uint16_t, uint8_t), void (*output_batch)(const struct key_event *, size_t),
+		 const macro& macro, uint64_t timeout, struct config* config);
+
+/*
+ * Returns the delay (us) before the next step, 0 once the macro is done.
+ * Callers wait at least a millisecond, the resolution of their timers.
+ */
+uint64_t macro_step(macro_task& task);
 
 int macro_parse(std::string_view, macro& macro, struct config* config, const smart_ptr<struct env_pack>&);
 #endif
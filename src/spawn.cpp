@@ -0,0 +1,199 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+#include "keyd.h"
+#include <spawn.h>
+#ifndef __FreeBSD__
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Commands are started without copying the daemon's address space:
+ * posix_spawn() when they run with our own credentials, vfork() when
+ * they have to switch to the user who issued them (posix_spawn has no
+ * attribute for that). Exited children are reaped from the event loop,
+ * only those started here, so other children keep their exit status.
+ */
+
+extern char **environ;
+
+struct spawn_stats spawn_stats;
+
+static int sigchld_pipe[2] = {-1, -1};
+
+// Commands which haven't been reaped yet
+static std::vector<pid_t> children;
+
+static int64_t get_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return int64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+static void on_sigchld(int)
+{
+	int err = errno;
+	if (write(sigchld_pipe[1], "", 1) < 0) {
+		// Already pending
+	}
+	errno = err;
+}
+
+int spawn_init()
+{
+	if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		perror("pipe2");
+		exit(-1);
+	}
+
+	struct sigaction sa{};
+	sa.sa_handler = on_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, nullptr);
+
+	return sigchld_pipe[0];
+}
+
+void spawn_reap()
+{
+	char buf[64];
+	if (sigchld_pipe[0] >= 0)
+		while (read(sigchld_pipe[0], buf, sizeof buf) > 0);
+
+	for (size_t i = 0; i < children.size();) {
+		int status;
+		pid_t pid = children[i];
+		pid_t r = waitpid(pid, &status, WNOHANG);
+		if (r == 0 || (r < 0 && errno == EINTR)) {
+			i++;
+			continue;
+		}
+
+		children[i] = children.back();
+		children.pop_back();
+		spawn_stats.running = children.size();
+		if (r < 0 || (WIFEXITED(status) && WEXITSTATUS(status) == 0))
+			continue;
+
+		spawn_stats.failed++;
+		if (WIFEXITED(status))
+			dbg("command %d exited with status %d", pid, WEXITSTATUS(status));
+		else
+			dbg("command %d terminated by signal %d", pid, WTERMSIG(status));
+	}
+}
+
+void spawn_report()
+{
+	const uint64_t started = spawn_stats.spawned + spawn_stats.failed;
+	if (!started)
+		return;
+
+	keyd_log("COMMAND: %zu spawned, %zu failed, %zu running, %zu us avg, %zu us max to start\n",
+		 size_t(spawn_stats.spawned), size_t(spawn_stats.failed), size_t(spawn_stats.running),
+		 size_t(spawn_stats.latency_ns / started / 1000), size_t(spawn_stats.max_latency_ns / 1000));
+}
+
+/* Runs in a vfork() child sharing our memory: system calls only. */
+static int child_setids(const env_pack& env)
+{
+#ifdef __FreeBSD__
+	if (env.gid && setgid(env.gid) < 0)
+		return -1;
+	if (env.uid && setuid(env.uid) < 0)
+		return -1;
+#else
+	// Bypass libc's process-wide setxid handling
+	if (env.gid && syscall(SYS_setgid, env.gid) < 0)
+		return -1;
+	if (env.uid && syscall(SYS_setuid, env.uid) < 0)
+		return -1;
+#endif
+	return 0;
+}
+
+static int spawn_as(pid_t& pid, const env_pack& env, char *const argv[], char *const envp[])
+{
+	volatile int err = 0;
+
+	pid = vfork();
+	if (pid == 0) {
+		int fd;
+		if (child_setids(env) < 0 || (fd = open("/dev/null", O_RDWR)) < 0) {
+			err = errno;
+			_exit(127);
+		}
+
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		if (fd > 2)
+			close(fd);
+
+		execve("/bin/sh", argv, envp);
+		err = errno;
+		_exit(127);
+	}
+
+	if (pid < 0)
+		return errno;
+
+	if (err) {
+		// The child has already exited
+		waitpid(pid, nullptr, 0);
+		return err;
+	}
+
+	return 0;
+}
+
+static int spawn(pid_t& pid, char *const argv[], char *const envp[])
+{
+	static posix_spawn_file_actions_t actions = [] {
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDWR, 0);
+		posix_spawn_file_actions_adddup2(&actions, 0, 1);
+		posix_spawn_file_actions_adddup2(&actions, 0, 2);
+		return actions;
+	}();
+
+	return posix_spawn(&pid, "/bin/sh", &actions, nullptr, argv, envp);
+}
+
+void execute_command(ucmd& cmd)
+{
+	dbg("executing command: %s", cmd.cmd.c_str());
+
+	const env_pack *env = cmd.env.get();
+	char *argv[] = {(char*)"/bin/sh", (char*)"-c", (char*)cmd.cmd.c_str(), nullptr};
+	char *const *envp = env && env->env ? (char *const *)env->env.get() : environ;
+
+	const int64_t start = get_time_ns();
+
+	pid_t pid;
+	int err = env && (env->uid || env->gid) ? spawn_as(pid, *env, argv, envp) : spawn(pid, argv, envp);
+
+	const uint64_t latency = get_time_ns() - start;
+	spawn_stats.latency_ns += latency;
+	spawn_stats.max_latency_ns = std::max(spawn_stats.max_latency_ns, latency);
+
+	if (err) {
+		spawn_stats.failed++;
+		keyd_log("COMMAND: y{WARNING} failed to run %s: %s\n", cmd.cmd.c_str(), strerror(err));
+		return;
+	}
+
+	children.push_back(pid);
+	spawn_stats.spawned++;
+	spawn_stats.running = children.size();
+	dbg("spawned %d in %zu us (%zu spawned, %zu failed, avg %zu us, max %zu us)", pid, size_t(latency / 1000),
+	    size_t(spawn_stats.spawned), size_t(spawn_stats.failed),
+	    size_t(spawn_stats.latency_ns / (spawn_stats.spawned + spawn_stats.failed) / 1000),
+	    size_t(spawn_stats.max_latency_ns / 1000));
+}
@@ -1,6 +1,7 @@
 /*
  * Smart pointer for single-thread simple use cases.
  * Aux allocator interface.
+ * Allocation watch.
  * License: MIT (see also: LICENSE).
  * © 2025 Nekotekina.
  */
@@ -10,6 +11,7 @@
 #include <cassert>
 #include <memory>
 #include <string_view>
+#include <array>
 
 using size_t = decltype(sizeof(char));
 
@@ -277,7 +279,7 @@ class aux_alloc {
 	// Get old value
 	bool old = use_aux_allocator;
 
-	friend void* operator new(size_t, std::align_val_t);
+	friend void* aux_allocate(size_t, std::align_val_t);
 
 public:
 	// Try to shrink latest allocation to new_size.
@@ -300,6 +302,60 @@ public:
 	}
 };
 
+// Counts allocations made while a scope is being watched (only in KEYD_ALLOC_WATCH builds, see operator new)
+class alloc_watch {
+	// Innermost watched scope
+	inline static const char* scope = nullptr;
+
+	const char* old = scope;
+
+public:
+	struct site {
+		const char* scope;
+		const void* caller; // Return address of operator new
+	};
+
+	inline static size_t count = 0;
+	inline static std::array<site, 16> sites{}; // First distinct call sites
+	inline static size_t nsites = 0;
+
+	static void record(const void* caller) noexcept
+	{
+		if (!scope)
+			return;
+		count++;
+		for (size_t i = 0; i < nsites; i++) {
+			if (sites[i].caller == caller)
+				return;
+		}
+		if (nsites < sites.size())
+			sites[nsites++] = {scope, caller};
+	}
+
+	static void reset() noexcept
+	{
+		count = 0;
+		nsites = 0;
+	}
+
+	explicit alloc_watch(const char* name) noexcept
+	{
+		scope = name;
+	}
+	alloc_watch(const alloc_watch&) = delete;
+	alloc_watch& operator=(const alloc_watch&) = delete;
+	~alloc_watch()
+	{
+		scope = old;
+	}
+};
+
+#ifdef KEYD_ALLOC_WATCH
+#define ALLOC_WATCH(name) alloc_watch _alloc_watch(name)
+#else
+#define ALLOC_WATCH(name) do {} while (0)
+#endif
+
 template <typename PT>
 inline void smart_ptr<PT>::shrink(size_t size) noexcept requires(is_sized && std::is_trivially_destructible_v<smart_ptr<PT>::T>)
 {
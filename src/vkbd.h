@@ -7,16 +7,22 @@
 #define VIRTUAL_KEYBOARD_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <memory>
 
 struct vkbd;
+struct key_event;
 
 struct vkbd* vkbd_init(const char *name);
 
 void vkbd_mouse_move(struct vkbd* vkbd, int x, int y);
 void vkbd_mouse_move_abs(struct vkbd* vkbd, int x, int y);
 void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y);
+/* Scroll by 1/120ths of a detent. */
+void vkbd_mouse_scroll_hi_res(struct vkbd* vkbd, int x, int y);
 
 void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state);
+/* Send a batch of key events using as few writes as possible. */
+void vkbd_send_keys(struct vkbd* vkbd, const struct key_event* events, size_t n);
 void vkbd_flush(struct vkbd* vkbd);
 #endif
@@ -13,6 +13,7 @@
 
 #include "../vkbd.h"
 #include "../keys.h"
+#include "../keyboard.h"
 
 struct vkbd {};
 
@@ -26,6 +27,11 @@ void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
 	printf("mouse scroll: x: %d, y: %d\n", x, y);
 }
 
+void vkbd_mouse_scroll_hi_res(struct vkbd* vkbd, int x, int y)
+{
+	printf("mouse scroll (hi-res): x: %d, y: %d\n", x, y);
+}
+
 void vkbd_mouse_move(struct vkbd* vkbd, int x, int y)
 {
 	printf("mouse movement: x: %d, y: %d\n", x, y);
@@ -41,6 +47,12 @@ void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 	printf("key: %s, state: %d\n", KEY_NAME(code), state);
 }
 
+void vkbd_send_keys(struct vkbd* vkbd, const struct key_event* events, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		vkbd_send_key(vkbd, events[i].code, events[i].pressed);
+}
+
 void vkbd_flush(struct vkbd*)
 {
 }
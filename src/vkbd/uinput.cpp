@@ -27,9 +27,16 @@ struct vkbd {
 	int fd = -1;
 	int pfd = -1;
 
-	// Buffered wheel events
+	// Buffered wheel motion in 1/120ths of a detent
 	int vwheel_buf = 0;
 	int hwheel_buf = 0;
+	// Partial detents already sent as hi-res motion
+	int vwheel_rem = 0;
+	int hwheel_rem = 0;
+
+	// Buffered keyboard events (each followed by EV_SYN)
+	struct input_event key_buf[128]{};
+	size_t key_buf_sz = 0;
 
 	vkbd(const char* name)
 		: name_base(name)
@@ -57,6 +64,25 @@ struct vkbd {
 		else if (fd_type == 1)
 			xwrite(this->pfd, ev, sizeof(ev));
 	}
+
+	void queue_kbd_event(uint16_t code, int32_t value)
+	{
+		if (key_buf_sz + 2 > std::size(key_buf))
+			flush_kbd_events();
+
+		key_buf[key_buf_sz].type = EV_KEY;
+		key_buf[key_buf_sz].code = code;
+		key_buf[key_buf_sz].value = value;
+		key_buf[key_buf_sz + 1].type = EV_SYN;
+		key_buf_sz += 2;
+	}
+
+	void flush_kbd_events()
+	{
+		if (key_buf_sz)
+			xwrite(this->fd, key_buf, key_buf_sz * sizeof(key_buf[0]));
+		key_buf_sz = 0;
+	}
 };
 
 static int create_virtual_keyboard(const char *name)
@@ -160,6 +186,8 @@ static int create_virtual_pointer(const char *name)
 	ioctl(fd, UI_SET_RELBIT, REL_X);
 	ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
 	ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+	ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+	ioctl(fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES);
 	ioctl(fd, UI_SET_RELBIT, REL_Y);
 	ioctl(fd, UI_SET_RELBIT, REL_Z);
 
@@ -185,11 +213,14 @@ static int create_virtual_pointer(const char *name)
 	return fd;
 }
 
+static bool is_mouse_button(uint16_t code)
+{
+	return code >= BTN_MOUSE && code < std::min(BTN_JOYSTICK, BTN_MOUSE + 16);
+}
+
 static void write_key_event(struct vkbd *vkbd, uint16_t code, int state)
 {
-	int is_btn = 0;
-	if (code >= BTN_MOUSE && code < std::min(BTN_JOYSTICK, BTN_MOUSE + 16))
-		is_btn = 1;
+	int is_btn = is_mouse_button(code);
 
 	if (is_btn) {
 		/*
@@ -221,13 +252,34 @@ struct vkbd* vkbd_init(const char* base_name)
 
 void vkbd_mouse_move(struct vkbd *vkbd, int x, int y)
 {
-	if (x)
-		vkbd->send_kbd_event(1, EV_REL, REL_X, x);
-	if (y)
-		vkbd->send_kbd_event(1, EV_REL, REL_Y, y);
+	// Both axes in a single frame
+	struct input_event ev[3]{};
+	size_t n = 0;
+
+	if (x) {
+		ev[n].type = EV_REL;
+		ev[n].code = REL_X;
+		ev[n++].value = x;
+	}
+	if (y) {
+		ev[n].type = EV_REL;
+		ev[n].code = REL_Y;
+		ev[n++].value = y;
+	}
+	if (!n)
+		return;
+
+	ev[n++].type = EV_SYN;
+	xwrite(vkbd->pfd, ev, n * sizeof(ev[0]));
 }
 
 void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
+{
+	vkbd->hwheel_buf += x * 120;
+	vkbd->vwheel_buf += y * 120;
+}
+
+void vkbd_mouse_scroll_hi_res(struct vkbd* vkbd, int x, int y)
 {
 	vkbd->hwheel_buf += x;
 	vkbd->vwheel_buf += y;
@@ -243,11 +295,12 @@ void vkbd_mouse_move_abs(struct vkbd* vkbd, int x, int y)
 
 void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 {
+	ALLOC_WATCH("vkbd_send_key");
 	dbg("output %s %s", KEY_NAME(code), state == 1 ? "down" : "up");
 
 	if (KEYD_WHEELEVENT(code) && state) {
 		// Buffer scroll events, a bit ugly but I hate to repeat constants
-		(code & 2 ? vkbd->hwheel_buf : vkbd->vwheel_buf) += (code & 1 ? -1 : 1);
+		(code & 2 ? vkbd->hwheel_buf : vkbd->vwheel_buf) += (code & 1 ? -120 : 120);
 		return;
 	}
 
@@ -256,11 +309,66 @@ void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 	write_key_event(vkbd, code, state);
 }
 
+void vkbd_send_keys(struct vkbd* vkbd, const struct key_event* events, size_t n)
+{
+	ALLOC_WATCH("vkbd_send_keys");
+	for (size_t i = 0; i < n; i++) {
+		uint16_t code = events[i].code;
+		int state = events[i].pressed;
+
+		if (KEYD_WHEELEVENT(code) || code > KEY_MAX || is_mouse_button(code)) {
+			// Keep ordering: everything queued so far goes first
+			vkbd->flush_kbd_events();
+			vkbd_send_key(vkbd, code, state);
+			continue;
+		}
+
+		dbg("output %s %s", KEY_NAME(code), state == 1 ? "down" : "up");
+		vkbd->queue_kbd_event(code, state);
+	}
+
+	vkbd->flush_kbd_events();
+}
+
+/*
+ * Append the buffered motion of one wheel axis: the hi-res value as is,
+ * and the legacy value once whole detents have accumulated.
+ */
+static size_t add_wheel_events(struct input_event *ev, int& buf, int& rem, uint16_t code, uint16_t hi_res_code)
+{
+	size_t n = 0;
+	int value = std::exchange(buf, 0);
+	if (!value)
+		return 0;
+
+	// Reversing drops the partial detent, as the kernel does
+	if ((value ^ rem) < 0)
+		rem = 0;
+	rem += value;
+
+	ev[n].type = EV_REL;
+	ev[n].code = hi_res_code;
+	ev[n++].value = value;
+	if (int detents = rem / 120) {
+		rem -= detents * 120;
+		ev[n].type = EV_REL;
+		ev[n].code = code;
+		ev[n++].value = detents;
+	}
+	return n;
+}
+
 void vkbd_flush(struct vkbd* vkbd)
 {
 	// TODO: implement key buffering as well
-	if (int y = std::exchange(vkbd->vwheel_buf, 0))
-		vkbd->send_kbd_event(1, EV_REL, REL_WHEEL, y);
-	if (int x = std::exchange(vkbd->hwheel_buf, 0))
-		vkbd->send_kbd_event(1, EV_REL, REL_HWHEEL, x);
+	struct input_event ev[5]{};
+	size_t n = 0;
+
+	n += add_wheel_events(ev + n, vkbd->vwheel_buf, vkbd->vwheel_rem, REL_WHEEL, REL_WHEEL_HI_RES);
+	n += add_wheel_events(ev + n, vkbd->hwheel_buf, vkbd->hwheel_rem, REL_HWHEEL, REL_HWHEEL_HI_RES);
+	if (!n)
+		return;
+
+	ev[n++].type = EV_SYN;
+	xwrite(vkbd->pfd, ev, n * sizeof(ev[0]));
 }
@@ -316,6 +316,11 @@ void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
 	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
 }
 
+void vkbd_mouse_scroll_hi_res(struct vkbd* vkbd, int x, int y)
+{
+	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
+}
+
 void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 {
 	if (update_modifier_state(code, state) < 0)
@@ -324,6 +329,13 @@ void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 	send_hid_report(vkbd);
 }
 
+void vkbd_send_keys(struct vkbd* vkbd, const struct key_event* events, size_t n)
+{
+	// Every state change requires its own report
+	for (size_t i = 0; i < n; i++)
+		vkbd_send_key(vkbd, events[i].code, events[i].pressed);
+}
+
 void vkbd_flush(struct vkbd*)
 {
 }
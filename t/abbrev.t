@@ -0,0 +1,27 @@
+v down
+v up
+v down
+v up
+v down
+v up
+x down
+x up
+
+v down
+v up
+v down
+v up
+v down
+v up
+x down
+backspace down
+backspace up
+backspace down
+backspace up
+backspace down
+backspace up
+o down
+o up
+k down
+k up
+x up
@@ -0,0 +1,15 @@
+f11 down
+f11 up
+h down
+h up
+j down
+x down
+j up
+x up
+
+h down
+h up
+j down
+x down
+j up
+x up
@@ -0,0 +1,12 @@
+f11 down
+f11 up
+g down
+g up
+1100ms
+x down
+x up
+
+b down
+b up
+x down
+x up
@@ -0,0 +1,11 @@
+f11 down
+f11 up
+g down
+g up
+s down
+s up
+
+leftcontrol down
+s down
+s up
+leftcontrol up
@@ -0,0 +1,16 @@
+f down
+f up
+x down
+x up
+30ms
+y down
+y up
+
+a down
+a up
+x down
+x up
+b down
+b up
+y down
+y up
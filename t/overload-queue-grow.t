@@ -0,0 +1,85 @@
+o down
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+o up
+
+a down
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+q down
+q up
+r down
+r up
+t down
+t up
+y down
+y up
+u down
+u up
+a up
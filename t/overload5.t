@@ -10,8 +10,6 @@ x up
 meta down
 control down
 meta up
-control up
-control down
 x down
 x up
 control up
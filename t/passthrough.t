@@ -0,0 +1,13 @@
+q down
+s down
+q up
+y down
+s up
+y up
+
+q down
+leftshift down
+q up
+y down
+leftshift up
+y up
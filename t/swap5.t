@@ -11,8 +11,6 @@ meta down
 alt down
 control down
 alt up
-control up
-control down
 tab down
 tab up
 x down
@@ -2,8 +2,11 @@
 #include <stdlib.h>
 #include <time.h>
 #include <sys/resource.h>
+#include <malloc.h>
 #include "../src/keyd.h"
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #define MAX_EVENTS 1024
 
@@ -30,10 +33,9 @@ static uint16_t lookup_code(const char *name)
 	if (!strcmp(name, "alt"))
 		return KEY_LEFTALT;
 
-	for (size_t i = 0; i <= KEY_MAX; i++)
-		if (keycode_table[i].name() == name)
-			return i;
-	return 0;
+	uint8_t kind;
+	int code = lookup_key_name(name, &kind);
+	return code > 0 && code <= KEY_MAX && kind == KEYNAME_MAIN ? code : 0;
 }
 
 static void send_key(uint16_t code, uint8_t pressed)
@@ -206,7 +208,49 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 	return 0;
 }
 
-uint64_t run_test(struct keyboard *kbd, const char *path)
+#ifdef KEYD_ALLOC_WATCH
+extern "C" const char __executable_start[];
+
+// Not inlined, so the return address is the allocating call site
+[[gnu::noinline]] void* operator new(size_t size)
+{
+	alloc_watch::record(__builtin_return_address(0));
+	if (void* v = malloc(size ? size : 1))
+		return v;
+	throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void* operator new(size_t size, std::align_val_t align)
+{
+	alloc_watch::record(__builtin_return_address(0));
+	if (void* v = aligned_alloc(size_t(align), (size + size_t(align) - 1) & -size_t(align)))
+		return v;
+	throw std::bad_alloc();
+}
+
+// Matching deletes, also kept out of line so each new pairs with a delete
+[[gnu::noinline]] void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+#endif
+
+uint64_t run_test(struct keyboard *kbd, const char *path, bool quiet = false)
 {
 	uint64_t time;
 	char *data = read_file(path);
@@ -230,12 +274,21 @@ uint64_t run_test(struct keyboard *kbd, const char *path)
 	time = get_time_ns() - time;
 	fflush(stdout);
 
+	// The mask mirrors layer_state for the first 64 layers
+	uint64_t layer_mask = 0;
+	for (size_t i = 0; i < std::min<size_t>(kbd->layer_state.size(), 64); i++)
+		layer_mask |= uint64_t(kbd->layer_state[i].active()) << i;
+	if (layer_mask != kbd->layer_mask) {
+		printf("%s \033[31;1mFAILED\033[0m (layer mask %zx, expected %zx)\n", path, size_t(kbd->layer_mask), size_t(layer_mask));
+		exit(-1);
+	}
+
 	if (cmp_events(output, noutput, expected, nexpected)) {
 		printf("Input: \n%s", ::input.c_str());
 		printf("%s \033[31;1mFAILED\033[0m\n", path);
 		print_diff(expected, nexpected, output, noutput);
 		exit(-1);
-	} else {
+	} else if (!quiet) {
 		printf("%s \033[32;1mPASSED\033[0m (%zu us)\n", path, size_t(time) / 1000);
 	}
 
@@ -243,14 +296,1016 @@ uint64_t run_test(struct keyboard *kbd, const char *path)
 	return time;
 }
 
+/* Plain typing throughput (ns per key stroke) on keys bound nowhere in the test config. */
+static uint64_t bench_typing(struct keyboard *kbd, bool fast_path)
+{
+	static const uint16_t keys[] = {KEY_Q, KEY_R, KEY_Y, KEY_U, KEY_I, KEY_T, KEY_G};
+	const size_t rounds = 20000;
+	struct key_event events[64];
+
+	for (size_t i = 0; i < ARRAY_SIZE(events); i++) {
+		events[i].code = keys[(i / 2) % ARRAY_SIZE(keys)];
+		events[i].pressed = !(i % 2);
+		events[i].timestamp = 0;
+	}
+
+	kbd->generic = !fast_path;
+
+	uint64_t time = get_time_ns();
+	for (size_t i = 0; i < rounds; i++) {
+		noutput = 0;
+		kbd_process_events(kbd, events, ARRAY_SIZE(events), true);
+	}
+	time = get_time_ns() - time;
+
+	kbd->generic = false;
+	return time / (rounds * ARRAY_SIZE(events) / 2);
+}
+
 static void on_layer_change(const struct keyboard *kbd, struct layer *layer, uint8_t active)
 {
 }
 
+static std::unique_ptr<keyboard> diff_keyboard(const char *path, const std::vector<const char*>& binds, bool generic)
+{
+	auto kbd = std::make_unique<::keyboard>();
+	kbd->output = {
+		.send_key = send_key,
+		.on_layer_change = on_layer_change,
+		.send_keys = nullptr,
+		.mouse_move = nullptr,
+	};
+
+	if (!config_parse(&kbd->config, path)) {
+		printf("Failed to parse config %s\n", path);
+		exit(-1);
+	}
+
+	kbd = new_keyboard(std::move(kbd));
+	kbd->config.finalize();
+	kbd_eval(kbd.get(), "unbind_all");
+	for (auto bind : binds) {
+		if (!kbd_eval(kbd.get(), bind)) {
+			printf("Invalid binding: %s\n", bind);
+			exit(-1);
+		}
+	}
+
+	kbd->update_layer_state();
+	kbd->generic = generic;
+	return kbd;
+}
+
+/* Time a long type() macro, replayed by pressing the key bound to it. */
+static uint64_t bench_macro(const char *path)
+{
+	auto kbd = diff_keyboard(path, {
+		"f = macro(type(The quick brown fox jumps over the lazy dog, 1234567890!))",
+	}, false);
+
+	const size_t rounds = 20000;
+	struct key_event events[2] = {
+		{ .code = KEY_F, .pressed = 1, .timestamp = 0 },
+		{ .code = KEY_F, .pressed = 0, .timestamp = 0 },
+	};
+
+	uint64_t time = get_time_ns();
+	for (size_t i = 0; i < rounds; i++) {
+		noutput = 0;
+		kbd_process_events(kbd.get(), events, 2, true);
+	}
+	time = get_time_ns() - time;
+
+	return time / rounds;
+}
+
+/*
+ * A config with 300 aliases and 300 layers (plus composites), parsed and
+ * then rebound as an application switch does: reset, then a few binds.
+ * Returns the parse time; bind_time gets the time per reset and bind set.
+ */
+static uint64_t bench_names(uint64_t& bind_time)
+{
+	char path[] = "/tmp/keyd-names-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(-1);
+	}
+
+	std::string conf = "[ids]\n*\n\n[aliases]\n";
+	for (int i = 0; i < 300; i++)
+		conf += std::string(1, 'a' + i % 26) + " = alias" + std::to_string(i) + "\n";
+	for (int i = 0; i < 300; i++) {
+		conf += "\n[layer" + std::to_string(i) + "]\n";
+		for (int j = 0; j < 10; j++)
+			conf += "alias" + std::to_string((i + j * 29) % 300) + " = layer(layer" + std::to_string((i + j + 1) % 300) + ")\n";
+		conf += "\n[layer" + std::to_string(i) + "+layer" + std::to_string((i + 1) % 300) + "]\nx = y\n";
+	}
+	if (write(fd, conf.data(), conf.size()) != ssize_t(conf.size()))
+		exit(-1);
+	close(fd);
+
+	auto kbd = std::make_unique<::keyboard>();
+	kbd->output = {
+		.send_key = send_key,
+		.on_layer_change = on_layer_change,
+		.send_keys = nullptr,
+		.mouse_move = nullptr,
+	};
+	uint64_t time = get_time_ns();
+	if (!config_parse(&kbd->config, path)) {
+		printf("Failed to parse config %s\n", path);
+		exit(-1);
+	}
+	time = get_time_ns() - time;
+	unlink(path);
+
+	kbd = new_keyboard(std::move(kbd));
+	kbd->config.finalize();
+	kbd->backup = std::make_unique<config_backup>(kbd->config);
+
+	const size_t rounds = 200;
+	bind_time = get_time_ns();
+	for (size_t i = 0; i < rounds; i++) {
+		char bind[128];
+		kbd_eval(kbd.get(), "reset");
+		for (int j = 0; j < 5; j++) {
+			int l = (i * 7 + j * 61) % 300;
+			snprintf(bind, sizeof bind, "layer%d.alias%d = macro(type(hello))", l, (l + j) % 300);
+			kbd_eval(kbd.get(), bind);
+			snprintf(bind, sizeof bind, "layer%d+layer%d.alias%d = z", l, (l + 7) % 300, (l * 3) % 300);
+			kbd_eval(kbd.get(), bind);
+		}
+	}
+	bind_time = (get_time_ns() - bind_time) / rounds;
+	return time;
+}
+
+/*
+ * One layer with 2000 bindings (250 keys under 8 modifier sets), parsed,
+ * then rebound one binding at a time. Returns the parse time in ns;
+ * bind_time gets the time of the 2000 runtime binds.
+ */
+static uint64_t bench_keymap(uint64_t& bind_time)
+{
+	char path[] = "/tmp/keyd-keymap-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(-1);
+	}
+
+	static const char *mods[] = {"", "C-", "S-", "A-", "M-", "C-S-", "C-A-", "A-S-"};
+	std::vector<std::string> binds;
+	std::string conf = "[ids]\n*\n\n[main]\n";
+	for (int code = 1, n = 0; n < 250; code++) {
+		if (!keycode_table[code].b_name)
+			continue;
+		for (auto m : mods)
+			binds.push_back(std::string(m) + keycode_table[code].name().data() + " = x");
+		n++;
+	}
+	for (auto& bind : binds)
+		conf += bind + "\n";
+	if (write(fd, conf.data(), conf.size()) != ssize_t(conf.size()))
+		exit(-1);
+	close(fd);
+
+	auto kbd = std::make_unique<::keyboard>();
+	uint64_t time = get_time_ns();
+	if (!config_parse(&kbd->config, path)) {
+		printf("Failed to parse config %s\n", path);
+		exit(-1);
+	}
+	kbd->config.finalize();
+	time = get_time_ns() - time;
+	unlink(path);
+
+	kbd_eval(kbd.get(), "unbind_all");
+	bind_time = get_time_ns();
+	for (auto& bind : binds)
+		kbd_eval(kbd.get(), bind);
+	bind_time = get_time_ns() - bind_time;
+	return time;
+}
+
+struct arena_stats {
+	size_t pages[2]; // Pages holding the bindings of all layers
+	size_t bytes[2]; // Memory holding them
+	uint64_t lookup[2]; // Time per keymap lookup (ns)
+};
+
+/*
+ * Parse 100 configs of 12 layers as a reload would, then compare their
+ * bindings in separate heap blocks (sorted as finalize() would) with the
+ * shared arenas. Each config has its own main layer and includes the
+ * other layers from a common file.
+ */
+static arena_stats bench_arena()
+{
+	char dir[] = "/tmp/keyd-arena-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		exit(-1);
+	}
+
+	std::vector<uint16_t> codes;
+	for (uint16_t code = 1; codes.size() < 60; code++) {
+		if (keycode_table[code].b_name)
+			codes.push_back(code);
+	}
+	auto layer = [&](int l) {
+		std::string s = l ? "\n[layer" + std::to_string(l) + "]\n" : "\n[main]\n";
+		for (auto code : codes)
+			s += std::string(keycode_table[code].name()) + " = " + keycode_table[codes[(code + l) % codes.size()]].name().data() + "\n";
+		return s + "a+s = x\n";
+	};
+
+	std::vector<std::string> paths;
+	auto write = [&](const std::string& path, const std::string& s) {
+		FILE *f = fopen(path.c_str(), "w");
+		fwrite(s.data(), 1, s.size(), f);
+		fclose(f);
+		paths.push_back(path);
+	};
+
+	std::string common;
+	for (int l = 1; l < 12; l++)
+		common += layer(l);
+	write(std::string(dir) + "/common", common);
+
+	arena_stats r{};
+	std::vector<std::unique_ptr<struct config>> configs;
+	for (int i = 0; i < 100; i++) {
+		write(std::string(dir) + "/dev" + std::to_string(i) + ".conf", "[ids]\n*\n" + layer(0) + "capslock = timeout(a, " + std::to_string(100 + i) + ", b)\n\ninclude common\n");
+		auto& config = *configs.emplace_back(std::make_unique<struct config>());
+		if (!config_parse(&config, paths.back().c_str())) {
+			printf("Failed to parse config %s\n", paths.back().c_str());
+			exit(-1);
+		}
+	}
+	for (auto& path : paths)
+		unlink(path.c_str());
+	rmdir(dir);
+
+	auto measure = [&](int i) {
+		std::vector<uintptr_t> pages;
+		auto add = [&](const auto& v) {
+			for (auto& e : v)
+				pages.push_back(uintptr_t(&e) / 4096);
+			// Heap blocks, including their malloc header
+			if (!v.frozen() && !v.empty())
+				r.bytes[i] += malloc_usable_size(const_cast<void*>(static_cast<const void*>(v.data()))) + sizeof(size_t);
+		};
+		std::vector<config_arena*> arenas;
+		for (auto& config : configs) {
+			for (auto& layer : config->layers) {
+				add(layer.keymap.mapv);
+				add(layer.chords);
+			}
+			for (auto& ref : config->frozen)
+				arenas.push_back(ref.arena);
+		}
+		std::sort(arenas.begin(), arenas.end());
+		arenas.erase(std::unique(arenas.begin(), arenas.end()), arenas.end());
+		for (auto arena : arenas)
+			r.bytes[i] += arena->size;
+		std::sort(pages.begin(), pages.end());
+		r.pages[i] = std::unique(pages.begin(), pages.end()) - pages.begin();
+
+		const size_t rounds = 20;
+		size_t found = 0, n = 0;
+		uint64_t time = get_time_ns();
+		for (size_t round = 0; round < rounds; round++) {
+			for (auto code : codes) {
+				descriptor key{};
+				key.id = code;
+				for (auto& config : configs) {
+					for (auto& layer : config->layers) {
+						found += !!layer.keymap[key];
+						n++;
+					}
+				}
+			}
+		}
+		r.lookup[i] = (get_time_ns() - time) / n;
+		if (!found)
+			exit(-1);
+	};
+
+	for (auto& config : configs) {
+		for (auto& layer : config->layers)
+			layer.keymap.sort();
+	}
+	measure(0);
+	for (auto& config : configs)
+		config->finalize();
+	measure(1);
+	return r;
+}
+
+/* Key lookup per character of `keyd input` text (ns per character). */
+static uint64_t bench_input_text()
+{
+	const std::string_view text = "The quick brown fox jumps over the lazy dog, 1234567890! \"Hello\" (world) [x] {y} <z> ~`@#$%^&*_+=|;:'?/.\n";
+	const size_t rounds = 2000;
+	uint64_t sum = 0;
+
+	uint64_t time = get_time_ns();
+	for (size_t i = 0; i < rounds; i++) {
+		for (size_t j = 0; j < text.size(); j++) {
+			uint16_t code;
+			uint8_t mods;
+			if (!parse_key_sequence(text.substr(j, 1), &code, &mods))
+				sum += code + mods;
+		}
+	}
+	time = get_time_ns() - time;
+
+	if (!sum)
+		exit(-1);
+	return time / (rounds * text.size());
+}
+
+/* Load 30 device configs sharing a large include, as a reload of such a config directory would. */
+static uint64_t bench_config_dir(int n, bool images)
+{
+	char dir[] = "/tmp/keyd-bench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		exit(-1);
+	}
+
+	std::string common = "[aliases]\nleftmeta = mykey\n";
+	for (int i = 0; i < 30; i++) {
+		common += "\n[common" + std::to_string(i) + "]\n";
+		common += "mykey = esc\n";
+		for (char c = 'a'; c <= 'z'; c++)
+			common += std::string(1, c) + " = macro(C-" + char('a' + (c - 'a' + i) % 26) + " space)\n";
+	}
+
+	std::vector<std::string> paths;
+	auto write = [&](const std::string& path, const std::string& s) {
+		FILE *f = fopen(path.c_str(), "w");
+		fwrite(s.data(), 1, s.size(), f);
+		fclose(f);
+		paths.push_back(path);
+	};
+
+	write(std::string(dir) + "/common", common);
+	for (int i = 0; i < n; i++) {
+		char buf[128];
+		snprintf(buf, sizeof buf, "[ids]\n%04x:%04x\n\n[main]\ncapslock = layer(common%d)\n\ninclude common\n", i, i, i);
+		write(std::string(dir) + "/dev" + std::to_string(i) + ".conf", buf);
+	}
+
+	// Images are written beforehand, as `keyd compile` would
+	std::vector<std::string> imgs;
+	for (int i = 0; images && i < n; i++) {
+		struct config config;
+		ini_cache sources;
+		imgs.push_back(paths[i + 1] + ".img");
+		if (!config_parse(&config, paths[i + 1].c_str(), &sources)) {
+			printf("Failed to parse config %s\n", paths[i + 1].c_str());
+			exit(-1);
+		}
+		config.finalize();
+		if (!config_write_image(&config, sources, imgs.back().c_str()))
+			exit(-1);
+	}
+
+	uint64_t time = get_time_ns();
+	for (int i = 0; i < n; i++) {
+		auto kbd = std::make_unique<::keyboard>();
+		if (images ? !config_load_image(&kbd->config, imgs[i].c_str())
+			   : !config_parse(&kbd->config, paths[i + 1].c_str())) {
+			printf("Failed to load config %s\n", paths[i + 1].c_str());
+			exit(-1);
+		}
+		kbd->config.finalize();
+	}
+	time = get_time_ns() - time;
+
+	for (auto& path : imgs)
+		unlink(path.c_str());
+	for (auto& path : paths)
+		unlink(path.c_str());
+	rmdir(dir);
+	return time;
+}
+
+/* Feed an input event the way the daemon does, expiring timeouts first. */
+static void diff_feed(struct keyboard *kbd, const struct key_event& ev, int64_t& deadline, std::vector<key_event>& out)
+{
+	noutput = 0;
+	while (deadline && deadline <= ev.timestamp) {
+		struct key_event tev = {};
+		tev.timestamp = deadline;
+		int64_t timeout = kbd_process_events(kbd, &tev, 1);
+		deadline = timeout > 0 ? deadline + timeout : 0;
+	}
+
+	int64_t timeout = kbd_process_events(kbd, &ev, 1, true);
+	deadline = timeout > 0 ? ev.timestamp + timeout : 0;
+	out.assign(output, output + noutput);
+}
+
+/*
+ * Differential test: random input is fed to keyboards using the selected
+ * engine variant and the generic one, which must produce identical output.
+ */
+static void run_differential(const char *path)
+{
+	static const std::vector<std::vector<const char*>> scenarios = {
+		{"a = b", "esc = clear()", "capslock = layer(control)", "1 = C-x", "shift.2 = 3"},
+		{"a = b", "capslock = layer(control)", "f = overloadt(control, f, 200)", "g = timeout(a, 100, b)"},
+		{"a = b", "capslock = layer(control)", "m = macro(C-h text(one))"},
+		{"a = b", "capslock = layer(control)", "j+k = esc", "control.h = left"},
+		{"a = b", "capslock = layer(control)", "control+shift.h = left", "shift.h = pageup"},
+		{"a = b", "j+k = esc", "f = overloadt(control, f, 200)", "m = macro(C-h text(one))", "control+shift.h = left"},
+	};
+	static const uint16_t keys[] = {
+		KEY_A, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_M, KEY_1, KEY_2, KEY_Q,
+		KEY_CAPSLOCK, KEY_LEFTSHIFT, KEY_LEFTCTRL, KEY_LEFTALT, KEY_ESC,
+	};
+
+	for (size_t i = 0; i < scenarios.size(); i++) {
+		auto kbd = diff_keyboard(path, scenarios[i], false);
+		auto ref = diff_keyboard(path, scenarios[i], true);
+		std::vector<key_event> out, ref_out;
+		int64_t deadline = 0, ref_deadline = 0;
+		uint32_t seed = 0x9e3779b9 + i;
+		int time = 0;
+
+		for (size_t j = 0; j < 20000; j++) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+
+			struct key_event ev = {};
+			ev.code = keys[seed % ARRAY_SIZE(keys)];
+			ev.pressed = !kbd->capstate[ev.code];
+			ev.timestamp = time += (seed >> 8) % 60;
+
+			diff_feed(kbd.get(), ev, deadline, out);
+			diff_feed(ref.get(), ev, ref_deadline, ref_out);
+
+			if (out.size() != ref_out.size() || !std::equal(out.begin(), out.end(), ref_out.begin(), [](auto& a, auto& b) {
+				return a.code == b.code && a.pressed == b.pressed;
+			})) {
+				printf("Differential test %zu \033[31;1mFAILED\033[0m at event %zu (%s %s)\n", i, j,
+				       keycode_table[ev.code].name().data(), ev.pressed ? "down" : "up");
+				print_diff(ref_out.data(), ref_out.size(), out.data(), out.size());
+				exit(-1);
+			}
+		}
+
+		printf("Differential test %zu (features 0x%x) \033[32;1mPASSED\033[0m\n", i, +kbd->config.features);
+	}
+}
+
 void aux_alloc::shrink(void*, size_t, size_t) noexcept
 {
 }
 
+/* Overloads pressed while typing resolve to their tap action immediately. */
+static void run_streak_test(const char *path)
+{
+	auto kbd = diff_keyboard(path, {"f = overloadt(control, f, 200)", "g = overload(shift, g)", "h = timeout(h, 200, layer(control))"}, false);
+	kbd->config.overload_streak_timeout = 100;
+	kbd->config.overload_tap_timeout = 0;
+
+	struct key_event input[] = {
+		{KEY_A, 1, 0}, {KEY_A, 0, 10},
+		{KEY_F, 1, 20}, {KEY_S, 1, 30}, {KEY_F, 0, 40}, {KEY_S, 0, 50},
+		{KEY_G, 1, 60}, {KEY_G, 0, 70},
+		{KEY_H, 1, 80}, {KEY_H, 0, 90},
+		// Not a streak
+		{KEY_G, 1, 500}, {KEY_S, 1, 510}, {KEY_S, 0, 520}, {KEY_G, 0, 530},
+	};
+	struct key_event expected[] = {
+		{KEY_A, 1, 0}, {KEY_A, 0, 0},
+		{KEY_F, 1, 0}, {KEY_S, 1, 0}, {KEY_F, 0, 0}, {KEY_S, 0, 0},
+		{KEY_G, 1, 0}, {KEY_G, 0, 0},
+		{KEY_H, 1, 0}, {KEY_H, 0, 0},
+		{KEY_LEFTSHIFT, 1, 0}, {KEY_S, 1, 0}, {KEY_S, 0, 0}, {KEY_LEFTSHIFT, 0, 0},
+	};
+
+	noutput = 0;
+	kbd_process_events(kbd.get(), input, ARRAY_SIZE(input), true);
+
+	if (cmp_events(output, noutput, expected, ARRAY_SIZE(expected)) || kbd->streak.resolved != 3 || kbd->streak.saved != 40) {
+		printf("Streak test \033[31;1mFAILED\033[0m (resolved %zu, saved %zu ms)\n", size_t(kbd->streak.resolved), size_t(kbd->streak.saved));
+		print_diff(expected, ARRAY_SIZE(expected), output, noutput);
+		exit(-1);
+	}
+
+	printf("Streak test \033[32;1mPASSED\033[0m\n");
+}
+
+/* Commands are spawned without blocking and reaped afterwards. */
+static void run_spawn_test(const char *path)
+{
+	auto kbd = diff_keyboard(path, {"f = command(true)", "g = command(exit 3)"}, false);
+
+	struct key_event input[] = {
+		{KEY_F, 1, 0}, {KEY_F, 0, 10},
+		{KEY_G, 1, 20}, {KEY_G, 0, 30},
+	};
+
+	// A child started elsewhere must be left to its owner
+	pid_t other = fork();
+	if (!other)
+		_exit(5);
+
+	const auto stats = spawn_stats;
+	kbd_process_events(kbd.get(), input, ARRAY_SIZE(input), true);
+
+	for (size_t i = 0; i < 2000 && spawn_stats.running; i++) {
+		usleep(1000);
+		spawn_reap();
+	}
+
+	int status = 0;
+	if (waitpid(other, &status, 0) != other || !WIFEXITED(status) || WEXITSTATUS(status) != 5) {
+		printf("Spawn test \033[31;1mFAILED\033[0m (reaped a foreign child)\n");
+		exit(-1);
+	}
+
+	if (spawn_stats.spawned - stats.spawned != 2 || spawn_stats.failed - stats.failed != 1 || spawn_stats.running) {
+		printf("Spawn test \033[31;1mFAILED\033[0m (spawned %zu, failed %zu, running %zu)\n",
+		       size_t(spawn_stats.spawned - stats.spawned), size_t(spawn_stats.failed - stats.failed),
+		       size_t(spawn_stats.running));
+		exit(-1);
+	}
+
+	printf("Spawn test \033[32;1mPASSED\033[0m (%zu us per command)\n",
+	       size_t(spawn_stats.latency_ns / spawn_stats.spawned / 1000));
+}
+
+static int mouse_x, mouse_y;
+static size_t mouse_frames;
+
+static void mouse_move(int x, int y)
+{
+	mouse_x += x;
+	mouse_y += y;
+	mouse_frames++;
+}
+
+/* Mouse keys motion is integrated per millisecond tick, keeping fractions. */
+static void run_mouse_test(const char *path)
+{
+	auto kbd = diff_keyboard(path, {"h = mousemove(1000, 0)", "n = mousemove(0, -333)"}, false);
+	kbd->output.mouse_move = mouse_move;
+	kbd->config.mouse_accel_time = 0;
+
+	struct key_event input[] = {
+		{KEY_H, 1, 0}, {KEY_H, 0, 100},
+		{KEY_N, 1, 200}, {KEY_N, 0, 500},
+	};
+
+	kbd_process_events(kbd.get(), input, ARRAY_SIZE(input), true);
+	const bool linear = mouse_x == 100 && mouse_y == -99 && mouse_frames <= 400;
+	const size_t frames = mouse_frames;
+
+	// Quadratic ramp from 20% over 100ms: about 47px
+	kbd->config.mouse_accel_time = 100;
+	kbd->config.mouse_initial_speed = 20;
+	mouse_x = mouse_y = 0;
+
+	struct key_event accel[] = {
+		{KEY_H, 1, 1000}, {KEY_H, 0, 1100},
+	};
+
+	kbd_process_events(kbd.get(), accel, ARRAY_SIZE(accel), true);
+
+	if (!linear || mouse_x < 45 || mouse_x > 48 || mouse_y) {
+		printf("Mouse test \033[31;1mFAILED\033[0m (%zu frames, accelerated x %d)\n", frames, mouse_x);
+		exit(-1);
+	}
+
+	printf("Mouse test \033[32;1mPASSED\033[0m\n");
+}
+
+/* A delayed macro keeps running while another keyboard gets input. */
+static void run_timeout_test(const char *path)
+{
+	std::vector<std::unique_ptr<keyboard>> kbds;
+	kbds.push_back(diff_keyboard(path, {"a = macro(x 100ms y)"}, false));
+	kbds.push_back(diff_keyboard(path, {}, false));
+
+	// The second macro waits in macro_queue for the first one
+	struct key_event macro[] = {
+		{KEY_A, 1, 0}, {KEY_A, 0, 10},
+		{KEY_A, 1, 20}, {KEY_A, 0, 30},
+	};
+	struct key_event other[] = {
+		{KEY_Q, 1, 50}, {KEY_Q, 0, 60},
+	};
+	struct key_event expected[] = {
+		{KEY_X, 1, 0}, {KEY_X, 0, 0},
+		{KEY_Q, 1, 0}, {KEY_Q, 0, 0},
+		{KEY_Y, 1, 0}, {KEY_Y, 0, 0},
+		{KEY_X, 1, 0}, {KEY_X, 0, 0},
+		{KEY_Y, 1, 0}, {KEY_Y, 0, 0},
+	};
+
+	noutput = 0;
+	kbd_process_events(kbds[0].get(), macro, ARRAY_SIZE(macro), true);
+	kbd_process_events(kbds[1].get(), other, ARRAY_SIZE(other), true);
+
+	// Wake up as the event loop would
+	int64_t time = 60;
+	for (int i = 0; i < 10; i++) {
+		if (int64_t next = kbd_run_timeouts(kbds, time))
+			time = next;
+		else
+			break;
+	}
+
+	if (cmp_events(output, noutput, expected, ARRAY_SIZE(expected))) {
+		printf("Timeout test \033[31;1mFAILED\033[0m\n");
+		print_diff(expected, ARRAY_SIZE(expected), output, noutput);
+		exit(-1);
+	}
+
+	// Gaps shorter than a millisecond are waited on the timer as well
+	auto kbd = diff_keyboard(path, {"b = macro(x y)"}, false);
+	kbd->config.macro_sequence_timeout = 500;
+	struct key_event tap[] = {{KEY_B, 1, 0}, {KEY_B, 0, 0}};
+	struct key_event first[] = {{KEY_X, 1, 0}, {KEY_X, 0, 0}};
+	noutput = 0;
+	int64_t timeout = kbd_process_events(kbd.get(), tap, ARRAY_SIZE(tap), true);
+	if (timeout != 1 || cmp_events(output, noutput, first, ARRAY_SIZE(first))) {
+		printf("Timeout test \033[31;1mFAILED\033[0m (macro gap, timeout %zd)\n", ssize_t(timeout));
+		print_diff(first, ARRAY_SIZE(first), output, noutput);
+		exit(-1);
+	}
+
+	printf("Timeout test \033[32;1mPASSED\033[0m\n");
+}
+
+/* Wheel ticks skip the engine only while no active layer binds them. */
+static void run_wheel_test(const char *path)
+{
+	auto kbd = diff_keyboard(path, {"a = layer(test2)", "test2.wheeldown = b"}, false);
+
+	struct key_event tap[] = {{KEY_Z, 1, 0}, {KEY_Z, 0, 0}};
+	kbd_process_events(kbd.get(), tap, ARRAY_SIZE(tap), true);
+	const bool idle = kbd_wheel_passthrough(kbd.get(), 0);
+
+	struct key_event down = {KEY_A, 1, 10};
+	kbd_process_events(kbd.get(), &down, 1, true);
+	const bool bound = kbd_wheel_passthrough(kbd.get(), 10);
+
+	struct key_event up = {KEY_A, 0, 20};
+	kbd_process_events(kbd.get(), &up, 1, true);
+	const bool released = kbd_wheel_passthrough(kbd.get(), 20);
+
+	if (!idle || bound || !released) {
+		printf("Wheel test \033[31;1mFAILED\033[0m (%d %d %d)\n", idle, bound, released);
+		exit(-1);
+	}
+
+	printf("Wheel test \033[32;1mPASSED\033[0m\n");
+}
+
+/*
+ * Once warmed up, key processing must not allocate: replay the test
+ * corpus and the typing benchmark while counting allocations.
+ */
+static void run_alloc_test(struct keyboard *kbd, int argc, char *argv[])
+{
+#ifdef KEYD_ALLOC_WATCH
+	alloc_watch::reset();
+	for (int i = 2; i < argc; i++)
+		run_test(kbd, argv[i], true);
+	bench_typing(kbd, false);
+	bench_typing(kbd, true);
+
+	if (alloc_watch::count) {
+		printf("Allocation test \033[31;1mFAILED\033[0m (%zu allocations)\n", alloc_watch::count);
+		// Resolve with addr2line -e bin/test-io
+		for (size_t i = 0; i < alloc_watch::nsites; i++)
+			printf("\tin %s, called from %p\n", alloc_watch::sites[i].scope, (void*)((const char*)alloc_watch::sites[i].caller - __executable_start));
+		exit(-1);
+	}
+
+	printf("Allocation test \033[32;1mPASSED\033[0m\n");
+#endif
+}
+
+/*
+ * Binds and resets update the derived key state incrementally; it must
+ * match a full recomputation (features may only be a superset).
+ */
+static void run_bind_test(const char *path)
+{
+	auto kbd = diff_keyboard(path, {"a = layer(test2)", "test2.b = macro(type(hello))"}, false);
+	kbd->backup = std::make_unique<config_backup>(kbd->config);
+
+	auto check = [&](const char *step) {
+		auto& cfg = kbd->config;
+		const auto special = cfg.special_keys;
+		const uint8_t features = cfg.features;
+		std::vector<std::bitset<KEYD_ENTRY_COUNT>> bound;
+		for (auto& layer : cfg.layers)
+			bound.push_back(layer.bound);
+
+		cfg.update_bound_keys();
+		cfg.update_features();
+		bool ok = special == cfg.special_keys && (features & cfg.features) == cfg.features;
+		for (size_t i = 0; i < bound.size(); i++)
+			ok = ok && bound[i] == cfg.layers[i].bound;
+		if (!ok) {
+			printf("Bind test \033[31;1mFAILED\033[0m (after %s)\n", step);
+			exit(-1);
+		}
+	};
+
+	for (const char *bind : {"control+alt.x = y", "test2.c = overloadt(control, d, 200)", "j+k = esc", "reset", "test2.e = f"}) {
+		if (!kbd_eval(kbd.get(), bind)) {
+			printf("Invalid binding: %s\n", bind);
+			exit(-1);
+		}
+		check(bind);
+	}
+
+	printf("Bind test \033[32;1mPASSED\033[0m\n");
+}
+
+/* Staged keymap bindings: the last one of a key wins, unbinding an unbound key adds nothing. */
+static void run_keymap_test()
+{
+	auto key = [](uint16_t id, enum op op, uint16_t code = 0) {
+		descriptor d{};
+		d.op = op;
+		d.id = id;
+		d.args[0].code = code;
+		return d;
+	};
+
+	descriptor_map staged, sorted;
+	for (auto d : {key(KEY_B, OP_KEYSEQUENCE, KEY_X), key(KEY_A, OP_KEYSEQUENCE, KEY_X), key(KEY_C, OP_NULL),
+		       key(KEY_A, OP_KEYSEQUENCE, KEY_Y), key(KEY_B, OP_NULL)}) {
+		staged.set(d, false);
+		sorted.set(d, true);
+	}
+	staged.sort();
+
+	const bool ok = staged.mapv.size() == 2 && staged.mapv[0].id == KEY_A && staged.mapv[0].args[0].code == KEY_Y &&
+			staged.mapv[1].id == KEY_B && !staged.mapv[1] && staged.mapv.size() == sorted.mapv.size() &&
+			std::equal(staged.mapv.begin(), staged.mapv.end(), sorted.mapv.begin(), [](auto& a, auto& b) {
+				return a == b && a.op == b.op && a.args[0].code == b.args[0].code;
+			});
+	if (!ok) {
+		printf("Keymap test \033[31;1mFAILED\033[0m\n");
+		exit(-1);
+	}
+
+	printf("Keymap test \033[32;1mPASSED\033[0m\n");
+}
+
+/*
+ * finalize() moves bindings to an arena, changed layers leave it until
+ * reset. Another config with the same bindings shares the arena, which
+ * outlives the config that packed it.
+ */
+static void run_arena_test(const char *path)
+{
+	const size_t tables = config_frozen_tables();
+	auto first = std::make_unique<struct config>();
+	auto kbd = std::make_unique<::keyboard>();
+	if (!config_parse(first.get(), path) || !config_parse(&kbd->config, path)) {
+		printf("Failed to parse config %s\n", path);
+		exit(-1);
+	}
+	kbd = new_keyboard(std::move(kbd));
+	first->finalize();
+	kbd->config.finalize();
+	kbd->backup = std::make_unique<config_backup>(kbd->config);
+
+	auto& cfg = kbd->config;
+	auto same_table = [](const frozen_ref& a, const frozen_ref& b) { return a.data == b.data; };
+	bool ok = !cfg.frozen.empty() && std::ranges::equal(first->frozen, cfg.frozen, same_table) && !cfg.layers[0].keymap.empty();
+	auto arena = cfg.frozen[0].arena;
+	for (auto& ref : cfg.frozen)
+		ok = ok && ref.arena == arena;
+	first.reset();
+
+	auto in_arena = [&](const auto& v) {
+		auto p = reinterpret_cast<const std::byte*>(v.data());
+		return v.empty() || (v.frozen() && p >= arena->base && p + v.size() * sizeof(v[0]) <= arena->base + arena->size);
+	};
+	for (auto& layer : cfg.layers)
+		ok = ok && in_arena(layer.keymap.mapv) && in_arena(layer.chords);
+
+	const auto frozen_main = cfg.layers[0].keymap.mapv.data();
+	ok = ok && kbd_eval(kbd.get(), "a = b") && !cfg.layers[0].keymap.mapv.frozen() && in_arena(cfg.layers[1].keymap.mapv);
+	ok = ok && kbd_eval(kbd.get(), "reset") && cfg.layers[0].keymap.mapv.data() == frozen_main;
+	if (!ok) {
+		printf("Arena test \033[31;1mFAILED\033[0m\n");
+		exit(-1);
+	}
+
+	// Tables are dropped from the registry with the last config using them
+	ok = kbd_eval(kbd.get(), "z = x");
+	cfg.finalize();
+	if (!ok || config_frozen_tables() != tables + 1) {
+		printf("Arena test \033[31;1mFAILED\033[0m (%zu tables after a bind, expected %zu)\n", config_frozen_tables(), tables + 1);
+		exit(-1);
+	}
+	kbd.reset();
+	if (config_frozen_tables() != tables) {
+		printf("Arena test \033[31;1mFAILED\033[0m (%zu tables left, expected %zu)\n", config_frozen_tables(), tables);
+		exit(-1);
+	}
+
+	printf("Arena test \033[32;1mPASSED\033[0m\n");
+}
+
+/*
+ * Configs with many [ids] (exact ids, vendor:product prefixes, exclusions,
+ * pointer-only ids and wildcards). The index must pick the same config as
+ * ranking every config with config_check_match(). Returns the time per
+ * lookup (ns) of both.
+ */
+static std::pair<uint64_t, uint64_t> run_match_test()
+{
+	std::vector<std::unique_ptr<struct config>> configs;
+	std::vector<std::string> devices;
+	config_match_index index;
+	auto add_id = [](struct config& config, uint8_t flags, const std::string& id) {
+		dev_id ent{flags, {}};
+		memcpy(ent.id.data(), id.data(), id.size());
+		config.ids.push_back(ent);
+	};
+
+	for (int i = 0; i < 200; i++) {
+		auto& config = *configs.emplace_back(std::make_unique<struct config>());
+		char vp[16], full[32];
+		snprintf(vp, sizeof vp, "%04x:%04x", i % 50, i % 7);
+		snprintf(full, sizeof full, "%s:%08x", vp, i * 2654435761u);
+		devices.push_back(full);
+		add_id(config, i % 5 ? ID_KEYBOARD | ID_MOUSE : ID_EXCLUDED, full);
+		add_id(config, i % 3 ? ID_KEYBOARD : ID_MOUSE | ID_ABS_PTR, vp);
+		add_id(config, ID_EXCLUDED, std::string(vp).substr(0, 4));
+		if (i % 40 == 0)
+			config.wildcard = i % 80 ? CAP_KEYBOARD : CAP_MOUSE | CAP_MOUSE_ABS;
+		index.add(&config);
+	}
+	devices.push_back("ffff:ffff:00000000");
+
+	auto brute = [&](const char *id, uint8_t flags) {
+		int match = -1, rank = 0;
+		for (size_t i = 0; i < configs.size(); i++) {
+			if (int r = config_check_match(configs[i].get(), id, flags); r > rank) {
+				match = i;
+				rank = r;
+			}
+		}
+		return match;
+	};
+
+	const uint8_t flag_sets[] = {ID_KEYBOARD, ID_MOUSE, ID_MOUSE | ID_ABS_PTR, ID_KEYBOARD | ID_MOUSE};
+	for (auto& dev : devices) {
+		for (uint8_t flags : flag_sets) {
+			if (brute(dev.c_str(), flags) != index.match(dev.c_str(), flags)) {
+				printf("Match test \033[31;1mFAILED\033[0m (%s, flags %u)\n", dev.c_str(), flags);
+				exit(-1);
+			}
+		}
+	}
+	printf("Match test \033[32;1mPASSED\033[0m\n");
+
+	const size_t rounds = 20;
+	int sum = 0;
+	uint64_t brute_time = get_time_ns();
+	for (size_t i = 0; i < rounds; i++)
+		for (auto& dev : devices)
+			sum += brute(dev.c_str(), ID_KEYBOARD);
+	brute_time = get_time_ns() - brute_time;
+	uint64_t index_time = get_time_ns();
+	for (size_t i = 0; i < rounds; i++)
+		for (auto& dev : devices)
+			sum -= index.match(dev.c_str(), ID_KEYBOARD);
+	index_time = get_time_ns() - index_time;
+	if (sum)
+		exit(-1);
+	return {brute_time / (rounds * devices.size()), index_time / (rounds * devices.size())};
+}
+
+/* Every name in keycode_table must resolve to its own entry. */
+static void run_key_name_test()
+{
+	for (int i = 0; i < KEYD_ENTRY_COUNT; i++) {
+		const auto& ent = keycode_table[i];
+		for (std::string_view name : {ent.name(), std::string_view(ent.key_num, 7),
+					      std::string_view(ent.alt_name ? ent.alt_name : ""),
+					      std::string_view(ent.shifted_name ? ent.shifted_name : "")}) {
+			if (!name.empty() && lookup_key_name(name) != i) {
+				printf("Key name test \033[31;1mFAILED\033[0m (%.*s)\n", (int)name.size(), name.data());
+				exit(-1);
+			}
+		}
+	}
+
+	if (lookup_key_name("nosuchkey") != -1 || lookup_key_name("") != -1) {
+		printf("Key name test \033[31;1mFAILED\033[0m (unknown name)\n");
+		exit(-1);
+	}
+
+	printf("Key name test \033[32;1mPASSED\033[0m\n");
+}
+
+/*
+ * A config loaded from its image must behave like the parsed one, and
+ * the image must be dropped once a source file changes.
+ */
+static void run_image_test(int argc, char *argv[])
+{
+	char dir[] = "/tmp/keyd-image-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		exit(-1);
+	}
+	auto img = std::string(dir) + "/test.conf.img";
+
+	struct config config;
+	ini_cache sources;
+	config_parse(&config, argv[1], &sources);
+	config.finalize();
+	if (!config_write_image(&config, sources, img.c_str())) {
+		printf("Image test \033[31;1mFAILED\033[0m (can't write %s)\n", img.c_str());
+		exit(-1);
+	}
+
+	auto kbd = std::make_unique<::keyboard>();
+	kbd->output = {
+		.send_key = send_key,
+		.on_layer_change = on_layer_change,
+		.send_keys = nullptr,
+		.mouse_move = nullptr,
+	};
+	if (!config_load_image(&kbd->config, img.c_str())) {
+		printf("Image test \033[31;1mFAILED\033[0m (can't load %s)\n", img.c_str());
+		exit(-1);
+	}
+	kbd = new_keyboard(std::move(kbd));
+	kbd->config.finalize();
+	for (int i = 2; i < argc; i++)
+		run_test(kbd.get(), argv[i], true);
+
+	auto conf = std::string(dir) + "/stale.conf";
+	auto stale = conf + ".img";
+	FILE *f = fopen(conf.c_str(), "w");
+	fputs("[main]\na = b\n", f);
+	fclose(f);
+	{
+		struct config first;
+		ini_cache first_sources;
+		config_parse(&first, conf.c_str(), &first_sources);
+		first.finalize();
+		config_write_image(&first, first_sources, stale.c_str());
+	}
+
+	// A table nobody shares yet is used from the mapped image
+	struct stat st;
+	struct config loaded;
+	bool in_place = !stat(stale.c_str(), &st) && config_load_image(&loaded, stale.c_str()) &&
+			loaded.frozen.size() == 1 && loaded.frozen[0].arena->size == size_t(st.st_size);
+
+	// Same size and modification time, other contents
+	stat(conf.c_str(), &st);
+	f = fopen(conf.c_str(), "w");
+	fputs("[main]\na = c\n", f);
+	fclose(f);
+	const struct timespec times[] = {st.st_atim, st.st_mtim};
+	utimensat(AT_FDCWD, conf.c_str(), times, 0);
+
+	struct config reloaded;
+	const bool fresh = config_load_image(&reloaded, stale.c_str());
+
+	unlink(img.c_str());
+	unlink(stale.c_str());
+	unlink(conf.c_str());
+	rmdir(dir);
+
+	if (!in_place) {
+		printf("Image test \033[31;1mFAILED\033[0m (tables were copied out of the image)\n");
+		exit(-1);
+	}
+
+	if (fresh) {
+		printf("Image test \033[31;1mFAILED\033[0m (stale image was loaded)\n");
+		exit(-1);
+	}
+
+	printf("Image test \033[32;1mPASSED\033[0m\n");
+}
+
 int main(int argc, char *argv[])
 {
 	rlimit lim{rlim_t(-1), rlim_t(-1)};
@@ -269,6 +1324,8 @@ int main(int argc, char *argv[])
 	kbd->output = {
 		.send_key = send_key,
 		.on_layer_change = on_layer_change,
+		.send_keys = nullptr,
+		.mouse_move = nullptr,
 	};
 
 	if (argc < 2) {
@@ -290,6 +1347,44 @@ int main(int argc, char *argv[])
 		total_time += run_test(kbd.get(), argv[i]);
 
 	printf("\nTotal time spent in the main loop: %zu us\n", size_t(total_time) / 1000);
+	printf("Event queue capacities: chord %u, pending key %u\n",
+	       kbd->queues.chord.cap, kbd->queues.pending_key.cap);
+
+	run_differential(argv[1]);
+	run_streak_test(argv[1]);
+	run_spawn_test(argv[1]);
+	run_mouse_test(argv[1]);
+	run_wheel_test(argv[1]);
+	run_timeout_test(argv[1]);
+	run_alloc_test(kbd.get(), argc, argv);
+	run_image_test(argc, argv);
+	run_key_name_test();
+	run_bind_test(argv[1]);
+	run_keymap_test();
+	auto [scan_match, index_match] = run_match_test();
+	run_arena_test(argv[1]);
+
+	uint64_t generic = bench_typing(kbd.get(), false);
+	uint64_t fast = bench_typing(kbd.get(), true);
+	printf("Plain typing: %zu ns/key (generic), %zu ns/key (pass-through)\n", size_t(generic), size_t(fast));
+	printf("Long type() macro: %zu ns\n", size_t(bench_macro(argv[1])));
+	printf("Text input key lookup: %zu ns/char\n", size_t(bench_input_text()));
+	uint64_t bind_time;
+	uint64_t keymap_time = bench_keymap(bind_time);
+	printf("2000 bindings in a layer: %zu us to parse, %zu us to bind at runtime\n",
+	       size_t(keymap_time / 1000), size_t(bind_time / 1000));
+	uint64_t names_time = bench_names(bind_time);
+	auto arena = bench_arena();
+	printf("Bindings of 100 configs: %zu pages, %zu KiB, %zu ns per lookup in heap blocks; %zu pages, %zu KiB, %zu ns in arenas\n",
+	       arena.pages[0], arena.bytes[0] / 1024, size_t(arena.lookup[0]), arena.pages[1], arena.bytes[1] / 1024, size_t(arena.lookup[1]));
+	printf("Device match (200 configs, 600 ids): %zu ns scanning configs, %zu ns with the index\n",
+	       size_t(scan_match), size_t(index_match));
+	printf("300 aliases and layers: %zu us to parse, %zu us per reset and 10 binds\n",
+	       size_t(names_time / 1000), size_t(bind_time / 1000));
+	uint64_t parsed = bench_config_dir(30, false);
+	uint64_t image = bench_config_dir(30, true);
+	printf("Config directory (30 configs, shared include): %zu us parsed, %zu us from images\n",
+	       size_t(parsed / 1000), size_t(image / 1000));
 	return 0;
 }
 